@@ -0,0 +1,58 @@
+/* Time to read source: mpc_parse building the AST, then lval_read turning
+   it into lvals. Prints one JSON object per line for bench/run.sh */
+#include "clispy.c"
+
+#define RUNS 20
+#define FORMS 2000
+
+/* A mix of definitions, data and comments like a typical library file */
+static char* bench_source(void) {
+  lbuf b = lbuf_new(NULL, -1);
+  for (int i = 0; i < FORMS; i++) {
+    lbuf_puts(&b, "; form ");
+    lbuf_put_long(&b, i);
+    lbuf_puts(&b, "\n(def {fn");
+    lbuf_put_long(&b, i);
+    lbuf_puts(&b, "} (\\ {x & xs} {if (> x 0) {join {x} xs} {\"none\\n\" #f}}))\n");
+    lbuf_puts(&b, "{");
+    lbuf_put_long(&b, i * 31);
+    lbuf_puts(&b, " -7 \"name\" sym {1 2 {3 4}} (x y)}\n");
+  }
+  return lbuf_take(&b);
+}
+
+int main(void) {
+  linterp* l = linterp_new();
+  char* source = bench_source();
+  size_t length = strlen(source);
+  mpc_result_t r;
+
+  long start = stats_clock();
+  for (int i = 0; i < RUNS; i++) {
+    if (!mpc_nparse("bench", source, length, l->Lispy, &r)) {
+      mpc_err_print(r.error);
+      return 1;
+    }
+    mpc_ast_delete(r.output);
+  }
+  long parse_usec = stats_clock() - start;
+
+  mpc_nparse("bench", source, length, l->Lispy, &r);
+  lstats before = stats;
+  start = stats_clock();
+  for (int i = 0; i < RUNS; i++) { lval_del(lval_read(r.output)); }
+  long read_usec = stats_clock() - start;
+  mpc_ast_delete(r.output);
+
+  long allocs = 0;
+  for (int i = 0; i != LVAL_TYPES; ++i) { allocs += stats.allocs[i] - before.allocs[i]; }
+
+  printf("{\"name\": \"mpc_parse\", \"runs\": %d, \"bytes\": %zu, "
+    "\"usec_per_run\": %ld}\n", RUNS, length, parse_usec / RUNS);
+  printf("{\"name\": \"lval_read\", \"runs\": %d, \"usec_per_run\": %ld, "
+    "\"allocs_per_run\": %ld}\n", RUNS, read_usec / RUNS, allocs / RUNS);
+
+  free(source);
+  linterp_del(l);
+  return 0;
+}
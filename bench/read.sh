@@ -0,0 +1,32 @@
+#!/bin/bash
+# Time to load the same data set from source text vs the binary format
+# Usage: bench/read.sh [path to lispy] [number of records]
+LISPY=${1:-./lispy}
+RECORDS=${2:-50000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# A list of small records mixing every kind of value the format stores
+awk -v n="$RECORDS" 'BEGIN {
+  printf "(def {data} {"
+  for (i = 0; i < n; i++) {
+    printf "{%d \"name %d\" sym%d {%d -%d #t} (x y)}\n", i, i, i % 100, i * 7, i, i
+  }
+  print "})"
+}' > "$DIR/data.clisp"
+
+echo '(dump "'"$DIR"'/data.clispb" (join {def {data}} (list data)))' \
+  | "$LISPY" "$DIR/data.clisp" > /dev/null
+
+TIMEFORMAT=%R
+echo "records: $RECORDS"
+echo "text:   $(wc -c < "$DIR/data.clisp") bytes"
+echo "binary: $(wc -c < "$DIR/data.clispb") bytes"
+for f in data.clisp data.clispb; do
+  echo -n "$f load seconds:"
+  for run in 1 2 3; do
+    t=$( { time "$LISPY" "$DIR/$f" < /dev/null > /dev/null; } 2>&1 )
+    echo -n " $t"
+  done
+  echo
+done
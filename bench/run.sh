@@ -0,0 +1,67 @@
+#!/bin/bash
+# Runs the workloads in bench/workloads, a large load, and the reader
+# microbenchmarks, printing the results as JSON. Wall time is the best of
+# the runs, the other numbers come from the interpreter's --stats
+# Usage: bench/run.sh [path to lispy] [path to bench/parse] [runs]
+LISPY=${1:-./lispy}
+PARSE=${2:-./bench/parse}
+RUNS=${3:-3}
+HERE=$(dirname "$0")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# A library sized file of definitions and data for load
+awk 'BEGIN {
+  for (i = 0; i < 5000; i++) {
+    printf "(def {f%d} (\\ {x y} {if (> x y) {- x y} {+ x y %d}}))\n", i, i
+    printf "(def {d%d} {%d \"entry %d\" s%d {1 2 3} (f%d 1 2)})\n", i, i, i, i % 50, i
+  }
+}' > "$DIR/load.clisp"
+
+# Data nested 100000 deep, which has to read, print and dump without error
+awk -v dir="$DIR" 'BEGIN {
+  printf "(def {nested} "
+  for (i = 0; i < 100000; i++) { printf "{" }
+  printf "1"
+  for (i = 0; i < 100000; i++) { printf "}" }
+  print ")"
+  print "(def {text} (to-string nested))"
+  printf "(dump \"%s/nested.clispb\" nested)\n", dir
+  printf "(def {back} (undump \"%s/nested.clispb\"))\n", dir
+}' > "$DIR/nested.clisp"
+
+# One benchmark object, stats lines turned into fields. Any arguments
+# after the file are passed to the interpreter
+workload() {
+  local name=$1 file=$2 best= t
+  shift 2
+  for run in $(seq "$RUNS"); do
+    t=$( { TIMEFORMAT=%R; time "$LISPY" --stats "$@" "$file" < /dev/null \
+      > "$DIR/out" 2> "$DIR/stats"; } 2>&1 )
+    best=$(awk -v a="$best" -v b="$t" 'BEGIN { print (a == "" || b < a) ? b : a }')
+  done
+  printf '    {"name": "%s", "wall_seconds": %s, "runs": %s, "errors": %s' \
+    "$name" "$best" "$RUNS" "$(grep -c '^Error' "$DIR/out")"
+  awk '{ gsub("-", "_", $1); printf ", \"%s\": %s", $1, $2 }' "$DIR/stats"
+  printf '}'
+}
+
+echo '{'
+echo "  \"version\": \"$(git -C "$HERE" describe --always --dirty 2>/dev/null || echo unknown)\","
+echo '  "benchmarks": ['
+for f in "$HERE"/workloads/*.clisp; do
+  workload "$(basename "$f" .clisp)" "$f"
+  echo ','
+done
+# The parallel workloads again without workers, to compare against
+for name in pmap spawn; do
+  workload "${name}_serial" "$HERE/workloads/$name.clisp" --workers 0
+  echo ','
+done
+workload nested "$DIR/nested.clisp"
+echo ','
+workload load "$DIR/load.clisp"
+"$PARSE" | while read -r line; do printf ',\n    %s' "$line"; done
+echo
+echo '  ]'
+echo '}'
@@ -0,0 +1,62 @@
+/* Time to get a usable parser: compiling the grammar text vs loading the image */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <time.h>
+
+#include "mpc.h"
+#include "grammar.h"
+
+#define RUNS 200
+
+typedef struct {
+  mpc_parser_t* ps[9];
+} parsers;
+
+static void parsers_new(parsers* p) {
+  const char* names[9] = { "number", "string", "comment", "boolean", "symbol",
+                           "sexpr", "qexpr", "expr", "lispy" };
+  for (int i = 0; i < 9; i++) { p->ps[i] = mpc_new(names[i]); }
+}
+
+static void parsers_del(parsers* p) {
+  mpc_cleanup(9, p->ps[0], p->ps[1], p->ps[2], p->ps[3], p->ps[4],
+    p->ps[5], p->ps[6], p->ps[7], p->ps[8]);
+}
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int compile(parsers* p) {
+  mpc_err_t* err = mpca_lang(MPCA_LANG_RULE_IDS, grammar_source, p->ps[0], p->ps[1],
+    p->ps[2], p->ps[3], p->ps[4], p->ps[5], p->ps[6], p->ps[7], p->ps[8]);
+  if (err) { mpc_err_print(err); mpc_err_delete(err); return 0; }
+  return 1;
+}
+
+static int load(parsers* p) {
+  mpc_err_t* err = mpc_load(grammar_image, grammar_image_len, 9, p->ps[0], p->ps[1],
+    p->ps[2], p->ps[3], p->ps[4], p->ps[5], p->ps[6], p->ps[7], p->ps[8]);
+  if (err) { mpc_err_print(err); mpc_err_delete(err); return 0; }
+  return 1;
+}
+
+static void bench(const char* name, int (*define)(parsers*)) {
+  parsers p;
+  double start = now();
+  for (int i = 0; i < RUNS; i++) {
+    parsers_new(&p);
+    if (!define(&p)) { return; }
+    parsers_del(&p);
+  }
+  printf("%-12s %10.1f us/run\n", name, (now() - start) / RUNS * 1e6);
+}
+
+int main(void) {
+  printf("image size   %10zu bytes\n", grammar_image_len);
+  bench("mpca_lang", compile);
+  bench("mpc_load", load);
+  return 0;
+}
@@ -0,0 +1,4571 @@
+// TODO: Improve error reporting
+#define _POSIX_C_SOURCE 200809L
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "clispy.h"
+#include "mpc.h"
+#include "mathutil.h"
+#include "grammar.h"
+#include "threadpool.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define write _write
+#endif
+
+#define LASSERT(args, cond, fmt, ...) \
+  if (!(cond)) { \
+    lval* err = lval_err(fmt, ##__VA_ARGS__); \
+    lval_del(args); \
+    return err; \
+  }
+
+typedef enum { LVAL_NUM = CLISPY_NUMBER, LVAL_ERR = CLISPY_ERROR,
+               LVAL_FUN = CLISPY_FUNCTION, LVAL_BOOL = CLISPY_BOOL,
+               LVAL_STR = CLISPY_STRING, LVAL_SYM = CLISPY_SYMBOL,
+               LVAL_SEXPR = CLISPY_SEXPR, LVAL_QEXPR = CLISPY_QEXPR,
+               LVAL_FUTURE = CLISPY_FUTURE, LVAL_CHAN = CLISPY_CHANNEL,
+               LVAL_SEQ = CLISPY_SEQUENCE } Val_Type;
+
+struct lval;
+struct lenv;
+struct linterp;
+struct lfuture;
+struct lchan;
+struct lseq;
+struct lmemo;
+struct ltrie;
+typedef struct lval lval;
+typedef struct lenv lenv;
+typedef struct linterp linterp;
+typedef struct lfuture lfuture;
+typedef struct lchan lchan;
+typedef struct lseq lseq;
+typedef struct lmemo lmemo;
+typedef struct ltrie ltrie;
+
+typedef lval*(*lbuiltin)(linterp*, lenv*, lval*);
+
+struct lval {
+  Val_Type type;
+  /* Basic */
+  long num;
+  bool boolean;
+  char* err;
+  char* sym;
+  char* string;
+  /* Functions */
+  lbuiltin builtin;
+  char* name;
+  lenv* env;
+  lval* formals;
+  lval* body;
+  /* Shared by copies of a memoized function, see memoize */
+  lmemo* memo;
+  /* Expression */
+  int count;
+  lval** cell;
+  /* Shared by copies of the future, see spawn */
+  lfuture* future;
+  /* Shared by copies of the channel, see chan */
+  lchan* chan;
+  /* Shared by copies of the sequence, see lseq */
+  lseq* seq;
+};
+
+struct lenv {
+  lenv* par;
+  /* A top level environment keeps its bindings here, see ltrie, and any
+     other in syms and vals */
+  ltrie* map;
+  int count;
+  char** syms;
+  lval** vals;
+};
+
+lval* lval_eval(linterp* l, lenv* e, lval* v);
+void lval_del(lval* v);
+lval* lval_err(char* err, ...);
+lval* lval_copy(lval* v);
+void lfuture_retain(lfuture* f);
+void lfuture_release(lfuture* f);
+void lchan_retain(lchan* c);
+void lchan_release(lchan* c);
+void lseq_retain(lseq* s);
+void lseq_release(lseq* s);
+void lmemo_retain(lmemo* m);
+void lmemo_release(lmemo* m);
+lval* lmemo_call(linterp* l, lenv* e, lval* f, lval* a);
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define THREAD_LOCAL _Thread_local
+#elif defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* Atomics, for what threads running parts of one interpreter share.
+   Without pthreads all of an interpreter's work runs on its own thread,
+   so plain reads and writes do */
+#ifdef _WIN32
+static long latomic_load(long* p) { return *p; }
+static void latomic_store(long* p, long n) { *p = n; }
+static long latomic_add(long* p, long n) { return *p += n; }
+static int latomic_cas(long* p, long old, long n) {
+  if (*p != old) { return 0; }
+  *p = n;
+  return 1;
+}
+#else
+static long latomic_load(long* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static void latomic_store(long* p, long n) { __atomic_store_n(p, n, __ATOMIC_RELEASE); }
+static long latomic_add(long* p, long n) { return __atomic_add_fetch(p, n, __ATOMIC_ACQ_REL); }
+static int latomic_cas(long* p, long old, long n) {
+  return __atomic_compare_exchange_n(p, &old, n, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+
+/* A lock for the few short sections that can't do without one */
+static void lspin_lock(long* p) {
+  while (!latomic_cas(p, 0, 1)) {
+#ifndef _WIN32
+    sched_yield();
+#endif
+  }
+}
+
+static void lspin_unlock(long* p) { latomic_store(p, 0); }
+
+/* Counters kept by the allocator, environment and evaluator. They're per
+   thread so the loader's workers don't contend on them, and load_files
+   adds what each file's parse cost back onto the main thread's */
+enum { LVAL_TYPES = LVAL_SEQ + 1 };
+
+typedef struct {
+  long allocs[LVAL_TYPES];
+  /* lval structs plus the strings they own */
+  long alloc_bytes;
+  long copies;
+  long frees;
+  long lookups;
+  /* Environments searched by lookups, and the most any one searched */
+  long lookup_depth;
+  long lookup_depth_max;
+  long builtin_calls;
+  long lambda_calls;
+  long parses;
+  long parse_usec;
+} lstats;
+
+THREAD_LOCAL lstats stats;
+
+void lstats_add(lstats* to, lstats* from) {
+  for (int i = 0; i != LVAL_TYPES; ++i) { to->allocs[i] += from->allocs[i]; }
+  to->alloc_bytes += from->alloc_bytes;
+  to->copies += from->copies;
+  to->frees += from->frees;
+  to->lookups += from->lookups;
+  to->lookup_depth += from->lookup_depth;
+  if (from->lookup_depth_max > to->lookup_depth_max) {
+    to->lookup_depth_max = from->lookup_depth_max;
+  }
+  to->builtin_calls += from->builtin_calls;
+  to->lambda_calls += from->lambda_calls;
+  to->parses += from->parses;
+  to->parse_usec += from->parse_usec;
+}
+
+/* Microseconds from an arbitrary start */
+long stats_clock(void) {
+#ifdef _WIN32
+  return (long)(clock() * (1000000.0 / CLOCKS_PER_SEC));
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000L + t.tv_nsec / 1000;
+#endif
+}
+
+lval* lval_alloc(Val_Type type) {
+  lval* v = malloc(sizeof(lval));
+  v->type = type;
+  stats.allocs[type]++;
+  stats.alloc_bytes += sizeof(lval);
+  return v;
+}
+
+/* A file already read by load, so if it's unchanged it isn't read and
+   parsed again */
+typedef struct load_entry {
+  char* path;
+  time_t mtime;
+  long mtime_nsec;
+  long long size;
+  lval* forms;
+  struct load_entry* next;
+} load_entry;
+
+/* Calls deeper than PROF_DEPTH wrap around the call stack, each putting
+   back the frame it replaced when it returns */
+enum { PROF_DEPTH = 128, PROF_SAMPLES = 1 << 16, PROF_FRAMES = 1 << 20 };
+
+typedef struct {
+  lbuiltin builtin;
+  char* name;
+} prof_frame;
+
+/* Everything one interpreter owns, so a process can run several on
+   different threads without them seeing each other */
+struct linterp {
+  mpc_parser_t* Number;
+  mpc_parser_t* String;
+  mpc_parser_t* Boolean;
+  mpc_parser_t* Comment;
+  mpc_parser_t* Symbol;
+  mpc_parser_t* Sexpr;
+  mpc_parser_t* Qexpr;
+  mpc_parser_t* Expr;
+  mpc_parser_t* Lispy;
+  /* The global environment */
+  lenv* env;
+  /* Counters while the interpreter isn't running, see linterp_enter */
+  lstats stats;
+  lstats saved;
+  int entered;
+  /* Builtins by name, so the binary format can store them. A name
+     registered twice refers to the later function, as it does in the
+     environment */
+  struct {
+    int count;
+    char** names;
+    lbuiltin* funcs;
+  } builtins;
+  /* Names given to lambdas by def, kept for the life of the interpreter
+     so copies of a function can share its name without copying it. Only
+     the root's is used, under 'lock', so names stay valid wherever
+     functions are sent */
+  struct {
+    size_t count;
+    size_t cap;
+    char** slots;
+  } names;
+  struct {
+    load_entry* entries;
+    long hits;
+    long misses;
+  } load_cache;
+  /* Functions being called, innermost at depth - 1 */
+  volatile prof_frame calls[PROF_DEPTH];
+  volatile int depth;
+  /* Threads pmap and preduce use besides the caller's, started when first
+     needed. 'workers' is -1 until set, for one per spare processor */
+  threadpool* pool;
+  int workers;
+  /* Threads for processes, one for each that's running */
+  threadpool* procs;
+  /* Processes and futures still running, which might yet send */
+  long running;
+  /* Set as the interpreter is freed, to stop processes waiting */
+  long stopping;
+  /* Guards the names and the lazily started pools */
+  long lock;
+  /* For the contexts pmap, spawn and process run in, the interpreter
+     whose parsers, builtins, names and pools they borrow */
+  linterp* root;
+};
+
+/* The interpreter l is, or is a context of */
+linterp* linterp_root(linterp* l) { return l->root ? l->root : l; }
+
+/* lvals are made everywhere, so rather than pass the interpreter to
+   every constructor the counters live in the thread's 'stats' while it
+   runs. A thread brackets its use of an interpreter with these, which
+   nest, as when a C builtin calls back into the interpreter */
+void linterp_enter(linterp* l) {
+  if (l->entered++) { return; }
+  l->saved = stats;
+  stats = l->stats;
+}
+
+void linterp_leave(linterp* l) {
+  if (--l->entered) { return; }
+  l->stats = stats;
+  stats = l->saved;
+}
+
+static unsigned long hash_string(char* s) {
+  unsigned long h = 5381;
+  while (*s) { h = h * 33 + (unsigned char)*s++; }
+  return h;
+}
+
+/* Top level bindings, as a persistent hash trie. A branch has a child for
+   each 5 bit piece of the hash set in its bitmap, and leaves hold the
+   bindings. def copies the path down to the leaf it changes and shares
+   the rest, so a version never changes once made. Contexts on other
+   threads each hold a version, see lenv_snapshot, and look names up in
+   it without locks while the environment's own thread goes on making new
+   ones. Nodes are freed by the last version to let go of them */
+enum { LTRIE_BITS = 5, LTRIE_MASK = (1 << LTRIE_BITS) - 1 };
+
+struct ltrie {
+  long refs;
+  /* Branches */
+  unsigned bitmap;
+  ltrie** kids;
+  /* Leaves. Those whose whole hashes match chain through 'next' */
+  char* sym;
+  unsigned long hash;
+  lval* val;
+  ltrie* next;
+};
+
+static int lbits_count(unsigned x) {
+  x = x - ((x >> 1) & 0x55555555u);
+  x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+  return (int)((((x + (x >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+}
+
+static unsigned ltrie_bit(unsigned long hash, int shift) {
+  return 1u << ((hash >> shift) & LTRIE_MASK);
+}
+
+/* An empty branch, which is also the empty trie */
+ltrie* ltrie_new(void) {
+  ltrie* t = calloc(1, sizeof(ltrie));
+  t->refs = 1;
+  stats.alloc_bytes += sizeof(ltrie);
+  return t;
+}
+
+static ltrie* ltrie_branch(unsigned bitmap) {
+  ltrie* t = ltrie_new();
+  t->bitmap = bitmap;
+  t->kids = malloc(sizeof(ltrie*) * lbits_count(bitmap));
+  stats.alloc_bytes += sizeof(ltrie*) * lbits_count(bitmap);
+  return t;
+}
+
+static ltrie* ltrie_leaf(char* sym, unsigned long hash, lval* val, ltrie* next) {
+  ltrie* t = ltrie_new();
+  t->sym = malloc(strlen(sym) + 1);
+  strcpy(t->sym, sym);
+  t->hash = hash;
+  t->val = val;
+  t->next = next;
+  return t;
+}
+
+ltrie* ltrie_retain(ltrie* t) {
+  if (t) { latomic_add(&t->refs, 1); }
+  return t;
+}
+
+void ltrie_release(ltrie* t) {
+  while (t && latomic_add(&t->refs, -1) == 0) {
+    ltrie* next = t->next;
+    if (t->sym) {
+      free(t->sym);
+      lval_del(t->val);
+    } else {
+      for (int i = 0; i != lbits_count(t->bitmap); ++i) { ltrie_release(t->kids[i]); }
+      free(t->kids);
+    }
+    free(t);
+    t = next;
+  }
+}
+
+/* The value bound to sym, which t keeps, or NULL */
+lval* ltrie_get(ltrie* t, char* sym, unsigned long hash) {
+  for (int shift = 0; !t->sym; shift += LTRIE_BITS) {
+    unsigned bit = ltrie_bit(hash, shift);
+    if (!(t->bitmap & bit)) { return NULL; }
+    t = t->kids[lbits_count(t->bitmap & (bit - 1))];
+  }
+  for (; t; t = t->next) {
+    if (t->hash == hash && strcmp(t->sym, sym) == 0) { return t->val; }
+  }
+  return NULL;
+}
+
+/* A copy of the chain t with sym bound to val. Chains are as rare as
+   whole hash collisions, so the leaves before it are simply copied */
+static ltrie* ltrie_chain_put(ltrie* t, char* sym, unsigned long hash, lval* val) {
+  if (!t) { return ltrie_leaf(sym, hash, val, NULL); }
+  if (strcmp(t->sym, sym) == 0) {
+    return ltrie_leaf(sym, hash, val, ltrie_retain(t->next));
+  }
+  return ltrie_leaf(t->sym, hash, lval_copy(t->val),
+    ltrie_chain_put(t->next, sym, hash, val));
+}
+
+/* A new version of t with sym bound to val, which it takes */
+ltrie* ltrie_put(ltrie* t, char* sym, unsigned long hash, lval* val, int shift) {
+  if (t->sym) {
+    if (t->hash == hash) { return ltrie_chain_put(t, sym, hash, val); }
+    /* Move the leaf down a level, where the hashes differ eventually */
+    ltrie* b = ltrie_branch(ltrie_bit(t->hash, shift));
+    b->kids[0] = ltrie_retain(t);
+    ltrie* x = ltrie_put(b, sym, hash, val, shift);
+    ltrie_release(b);
+    return x;
+  }
+
+  unsigned bit = ltrie_bit(hash, shift);
+  int i = lbits_count(t->bitmap & (bit - 1));
+  int count = lbits_count(t->bitmap);
+  ltrie* x = ltrie_branch(t->bitmap | bit);
+  if (t->bitmap & bit) {
+    for (int j = 0; j != count; ++j) {
+      x->kids[j] = j == i
+        ? ltrie_put(t->kids[i], sym, hash, val, shift + LTRIE_BITS)
+        : ltrie_retain(t->kids[j]);
+    }
+  } else {
+    for (int j = 0; j != i; ++j) { x->kids[j] = ltrie_retain(t->kids[j]); }
+    x->kids[i] = ltrie_leaf(sym, hash, val, NULL);
+    for (int j = i; j != count; ++j) { x->kids[j + 1] = ltrie_retain(t->kids[j]); }
+  }
+  return x;
+}
+
+long ltrie_count(ltrie* t) {
+  if (t->sym) { return 1 + (t->next ? ltrie_count(t->next) : 0); }
+  long n = 0;
+  for (int i = 0; i != lbits_count(t->bitmap); ++i) { n += ltrie_count(t->kids[i]); }
+  return n;
+}
+
+/* Calls fn on each binding until it returns an error, which is returned */
+lval* ltrie_each(ltrie* t, lval* (*fn)(void*, char*, lval*), void* arg) {
+  lval* err = NULL;
+  if (t->sym) {
+    for (; t && !err; t = t->next) { err = fn(arg, t->sym, t->val); }
+    return err;
+  }
+  for (int i = 0; i != lbits_count(t->bitmap) && !err; ++i) {
+    err = ltrie_each(t->kids[i], fn, arg);
+  }
+  return err;
+}
+
+lenv* lenv_new(void) {
+  lenv* e = malloc(sizeof(lenv));
+  e->count = 0;
+  e->syms = NULL;
+  e->vals = NULL;
+  e->par = NULL;
+  e->map = NULL;
+  return e;
+} 
+
+/* A top level environment holding the version 'map', which it takes */
+lenv* lenv_top(ltrie* map) {
+  lenv* e = lenv_new();
+  e->map = map;
+  return e;
+}
+
+void lenv_del(lenv* e) {
+  ltrie_release(e->map);
+  for (int i = 0; i != e->count; ++i) {
+    free(e->syms[i]);
+    lval_del(e->vals[i]);
+  }
+  free(e->syms);
+  free(e->vals);
+  free(e);
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+  long depth = 0;
+  lval* v = NULL;
+  stats.lookups++;
+
+  for (; e && !v; e = e->par) {
+    depth++;
+    if (e->map) {
+      v = ltrie_get(e->map, k->sym, hash_string(k->sym));
+      continue;
+    }
+    for (int i = 0; i != e->count; ++i) {
+      if (strcmp(e->syms[i], k->sym) == 0) { v = e->vals[i]; break; }
+    }
+  }
+
+  stats.lookup_depth += depth;
+  if (depth > stats.lookup_depth_max) { stats.lookup_depth_max = depth; }
+  return v ? lval_copy(v) : lval_err("unbound symbol '%s'!", k->sym);
+}
+
+/* Binds sym to v, which it takes, in the top level environment e. The old
+   version goes once no snapshot holds it */
+void lenv_bind(lenv* e, char* sym, lval* v) {
+  ltrie* old = e->map;
+  e->map = ltrie_put(old, sym, hash_string(sym), v, 0);
+  ltrie_release(old);
+}
+
+void lenv_put(lenv* e, lval* k, lval* v) {
+  if (e->map) {
+    lenv_bind(e, k->sym, lval_copy(v));
+    return;
+  }
+  for (int i = 0; i != e->count; ++i) {
+    if (strcmp(e->syms[i], k->sym) == 0) {
+      lval_del(e->vals[i]);
+      e->vals[i] = lval_copy(v);
+      return;
+    }
+  }
+
+  e->count++;
+  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+  e->syms = realloc(e->syms, sizeof(char*) * e->count);
+
+  e->vals[e->count-1] = lval_copy(v);
+  e->syms[e->count-1] = malloc(strlen(k->sym)+1);
+  strcpy(e->syms[e->count-1], k->sym);
+}
+
+void lenv_def(lenv* e, lval* k, lval* v) {
+  /* Iterate till e has no parent */
+  while (e->par) { e = e->par; }
+  /* Put value in e */
+  lenv_put(e, k, v);
+}
+
+/* A top level environment holding everything visible from e. Only the
+   local bindings are copied, onto the top level's current version */
+lenv* lenv_snapshot(lenv* e) {
+  if (e->map) { return lenv_top(ltrie_retain(e->map)); }
+
+  lenv* s = e->par ? lenv_snapshot(e->par) : lenv_top(ltrie_new());
+  for (int i = 0; i != e->count; ++i) {
+    lenv_bind(s, e->syms[i], lval_copy(e->vals[i]));
+  }
+  return s;
+}
+
+lval* lval_lambda(lval* formals, lval* body) {
+  lval* v = lval_alloc(LVAL_FUN);
+  v->builtin = NULL;
+  v->name = NULL;
+  v->memo = NULL;
+
+  v->env = lenv_new();
+
+  v->formals = formals;
+  v->body = body;
+  return v;
+}
+
+lval* lval_num(long x) {
+  lval* v = lval_alloc(LVAL_NUM);
+  v->num = x;
+  return v;
+}
+
+lval* lval_str(char* s) {
+  lval* v = lval_alloc(LVAL_STR);
+  v->string = malloc(strlen(s) + 1);
+  strcpy(v->string, s);
+  stats.alloc_bytes += strlen(s) + 1;
+  return v;
+}
+
+lval* lval_bool(bool b) {
+  lval* v = lval_alloc(LVAL_BOOL);
+  v->boolean = b;
+  return v;
+}
+
+lval* lval_err(char* fmt, ...) {
+  lval* v = lval_alloc(LVAL_ERR);
+
+  /* Create a va list and initialize it */
+  va_list va;
+  va_start(va, fmt);
+
+  /* Allocate 512 bytes of space */
+  v->err = malloc(512);
+
+  /* printf the error string with a maximum of 511 characters */
+  vsnprintf(v->err, 511, fmt, va);
+
+  /* Reallocate to number of bytes actually used */
+  v->err = realloc(v->err, strlen(v->err)+1);
+  stats.alloc_bytes += strlen(v->err) + 1;
+
+  /* Cleanup our va list */
+  va_end(va);
+
+  return v;
+}
+
+lval* lval_fun(lbuiltin func) {
+  lval* v = lval_alloc(LVAL_FUN);
+  v->builtin = func;
+  v->name = NULL;
+  v->memo = NULL;
+  return v;
+}
+
+lval* lval_sym(char* y) {
+  lval* v = lval_alloc(LVAL_SYM);
+  v->sym = malloc(strlen(y) + 1);
+  strcpy(v->sym, y);
+  stats.alloc_bytes += strlen(y) + 1;
+  return v;
+}
+
+lval* lval_sexpr(void) {
+  lval* v = lval_alloc(LVAL_SEXPR);
+  v->count = 0;
+  v->cell = NULL;
+  return v;
+}
+
+lval* lval_qexpr(void) {
+  lval* v = lval_alloc(LVAL_QEXPR);
+  v->count = 0;
+  v->cell = NULL;
+  return v;
+}
+
+void lval_del(lval* v) {
+  switch (v->type) {
+    case LVAL_NUM: 
+    case LVAL_BOOL:
+      break;
+    case LVAL_STR:
+      free(v->string);
+      break;
+    case LVAL_FUN:
+      if (v->builtin == NULL) {
+        lenv_del(v->env);
+        lval_del(v->formals);
+        lval_del(v->body);
+      }
+      if (v->memo) { lmemo_release(v->memo); }
+      break;
+    case LVAL_ERR:
+      free(v->err);
+      break;
+    case LVAL_SYM:
+      free(v->sym);
+      break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      for (int i = 0; i != v->count; ++i) {
+        lval_del(v->cell[i]);
+      }
+      free(v->cell);
+      break;
+    case LVAL_FUTURE:
+      lfuture_release(v->future);
+      break;
+    case LVAL_CHAN:
+      lchan_release(v->chan);
+      break;
+    case LVAL_SEQ:
+      lseq_release(v->seq);
+      break;
+  }
+
+  stats.frees++;
+  free(v);
+}
+
+lval* lval_read_num(mpc_ast_t* t) {
+  errno = 0;
+  long x = strtol(t->contents, NULL, 10);
+  return errno != ERANGE ?
+    lval_num(x) : lval_err("invalid number");
+}
+
+lval* lval_add(lval* v, lval* x) {
+  v->count++;
+  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  v->cell[v->count - 1] = x;
+  return v;
+}
+
+lval* lval_read_str(mpc_ast_t* t) {
+  /* Cut off the final quote character */
+  t->contents[strlen(t->contents)-1] = '\0';
+  /* Copy the string missing out the first quote character */
+  char* unescaped = malloc(strlen(t->contents+1)+1);
+  strcpy(unescaped, t->contents+1);
+  /* Pass through the unescape function */
+  unescaped = mpcf_unescape(unescaped);
+  /* Construct a new lval using the string */
+  lval* str = lval_str(unescaped);
+  /* Free the string and return */
+  free(unescaped);
+  return str;
+}
+
+/* Reads a number, boolean, symbol or string, or returns NULL for a node
+   whose children make up a list */
+static lval* lval_read_atom(mpc_ast_t* t) {
+  switch (t->rule) {
+    case RULE_NUMBER: return lval_read_num(t);
+    case RULE_BOOLEAN: return lval_bool(strcmp(t->contents, "#t") == 0);
+    case RULE_SYMBOL: return lval_sym(t->contents);
+    case RULE_STRING: return lval_read_str(t);
+    default: return NULL;
+  }
+}
+
+/* How deeply read lists may nest, zero for no limit. Values are still
+   copied and freed recursively, and copying, the deepest of those, runs
+   out of an 8MB stack a little past 130000 levels. See
+   clispy_set_max_depth */
+enum { READ_DEPTH_DEFAULT = 120000 };
+static int read_depth_max = READ_DEPTH_DEFAULT;
+
+/* A little over the parser frames each level of nesting takes, so the
+   parser's limit follows read_depth_max. Input just past it reads as too
+   deep, and input far past it stops the parser before it's all built */
+enum { PARSE_FRAMES_PER_LEVEL = 10, PARSE_FRAMES_BASE = 64 };
+
+/* A list being read, and the next of its node's children to look at */
+typedef struct {
+  mpc_ast_t* t;
+  lval* x;
+  int i;
+} lread_frame;
+
+/* Reads lists on a stack of its own rather than the C stack, so the only
+   limit on their nesting is read_depth_max */
+lval* lval_read(mpc_ast_t* t) {
+  lval* x = lval_read_atom(t);
+  if (x) { return x; }
+
+  int count = 1, slots = 16;
+  lread_frame* stack = malloc(sizeof(lread_frame) * slots);
+  /* The top level has no rule of its own */
+  stack[0].t = t;
+  stack[0].x = t->rule == RULE_QEXPR ? lval_qexpr() : lval_sexpr();
+  stack[0].i = 0;
+
+  for (;;) {
+    lread_frame* f = &stack[count - 1];
+
+    if (f->i == f->t->children_num) {
+      x = f->x;
+      if (--count == 0) { break; }
+      lval_add(stack[count - 1].x, x);
+      continue;
+    }
+
+    mpc_ast_t* c = f->t->children[f->i++];
+    /* Brackets and anchors belong to no rule */
+    if (c->rule == 0 || c->rule == RULE_COMMENT) { continue; }
+
+    lval* y = lval_read_atom(c);
+    if (y) {
+      lval_add(f->x, y);
+      continue;
+    }
+
+    /* The top level isn't a list of the input's own */
+    if (read_depth_max && count > read_depth_max) {
+      while (count) { lval_del(stack[--count].x); }
+      free(stack);
+      return lval_err("Maximum nesting depth exceeded!");
+    }
+    if (count == slots) {
+      slots *= 2;
+      stack = realloc(stack, sizeof(lread_frame) * slots);
+    }
+    stack[count].t = c;
+    stack[count].x = c->rule == RULE_QEXPR ? lval_qexpr() : lval_sexpr();
+    stack[count].i = 0;
+    count++;
+  }
+
+  free(stack);
+  return x;
+}
+
+/* Output buffer that values are printed into. If it has a FILE* or fd to
+   go to it's written out a chunk at a time, otherwise it grows to hold
+   everything, for to-string */
+enum { LBUF_CHUNK = 1 << 16 };
+
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+  FILE* file;
+  int fd;
+} lbuf;
+
+lbuf lbuf_new(FILE* file, int fd) {
+  lbuf b = { NULL, 0, 0, file, fd };
+  return b;
+}
+
+void lbuf_flush(lbuf* b) {
+  if (b->file) {
+    fwrite(b->data, 1, b->len, b->file);
+  } else if (b->fd >= 0) {
+    size_t done = 0;
+    while (done < b->len) {
+      long n = write(b->fd, b->data + done, b->len - done);
+      if (n <= 0) { break; }
+      done += n;
+    }
+  } else {
+    return;
+  }
+  b->len = 0;
+}
+
+static void lbuf_reserve(lbuf* b, size_t n) {
+  if (b->len + n <= b->cap) { return; }
+  if ((b->file || b->fd >= 0) && b->len + n > LBUF_CHUNK) {
+    lbuf_flush(b);
+    if (n <= b->cap) { return; }
+  }
+  size_t cap = b->cap ? b->cap * 2 : 256;
+  while (cap < b->len + n) { cap *= 2; }
+  b->data = realloc(b->data, cap);
+  b->cap = cap;
+}
+
+void lbuf_put(lbuf* b, const char* s, size_t n) {
+  lbuf_reserve(b, n);
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+}
+
+void lbuf_putc(lbuf* b, char c) {
+  lbuf_reserve(b, 1);
+  b->data[b->len++] = c;
+}
+
+void lbuf_puts(lbuf* b, const char* s) { lbuf_put(b, s, strlen(s)); }
+
+void lbuf_put_long(lbuf* b, long x) {
+  char digits[24];
+  int i = sizeof(digits);
+  /* Negate digit by digit so the most negative long works too */
+  unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+  do { digits[--i] = '0' + u % 10; u /= 10; } while (u);
+  if (x < 0) { digits[--i] = '-'; }
+  lbuf_put(b, digits + i, sizeof(digits) - i);
+}
+
+/* Writes s with the same escapes as mpcf_escape, without copying it first */
+void lbuf_put_escaped(lbuf* b, const char* s) {
+  const char* run = s;
+  for (; *s; s++) {
+    const char* esc;
+    switch (*s) {
+      case '\a': esc = "\\a"; break;
+      case '\b': esc = "\\b"; break;
+      case '\f': esc = "\\f"; break;
+      case '\n': esc = "\\n"; break;
+      case '\r': esc = "\\r"; break;
+      case '\t': esc = "\\t"; break;
+      case '\v': esc = "\\v"; break;
+      case '\\': esc = "\\\\"; break;
+      case '\'': esc = "\\'"; break;
+      case '\"': esc = "\\\""; break;
+      default: continue;
+    }
+    lbuf_put(b, run, s - run);
+    lbuf_put(b, esc, 2);
+    run = s + 1;
+  }
+  lbuf_put(b, run, s - run);
+}
+
+/* Returns what's been written as a string, which the caller frees */
+char* lbuf_take(lbuf* b) {
+  lbuf_putc(b, '\0');
+  char* s = b->data;
+  b->data = NULL;
+  b->len = b->cap = 0;
+  return s;
+}
+
+void lbuf_del(lbuf* b) {
+  lbuf_flush(b);
+  free(b->data);
+}
+
+void lval_write(lbuf* b, lval* v);
+
+/* Write anything but a list */
+static void lval_write_atom(lbuf* b, lval* v) {
+  switch (v->type) {
+    case LVAL_NUM: 
+      lbuf_put_long(b, v->num);
+      break;
+
+    case LVAL_STR:
+      lbuf_putc(b, '"');
+      lbuf_put_escaped(b, v->string);
+      lbuf_putc(b, '"');
+      break;
+
+    case LVAL_BOOL:
+      lbuf_puts(b, v->boolean ? "#t" : "#f");
+      break;
+    case LVAL_ERR:
+      lbuf_puts(b, "Error: ");
+      lbuf_puts(b, v->err);
+      lbuf_putc(b, '\n');
+      break;
+
+    case LVAL_FUN:
+      if (v->builtin) {
+        lbuf_puts(b, "<builtin>");
+      } else {
+        lbuf_puts(b, "(\\ "); lval_write(b, v->formals);
+        lbuf_putc(b, ' '); lval_write(b, v->body); lbuf_putc(b, ')');
+      }
+      break;
+
+    case LVAL_SYM:
+      lbuf_puts(b, v->sym);
+      break;
+
+    case LVAL_FUTURE:
+      lbuf_puts(b, "<future>");
+      break;
+
+    case LVAL_CHAN:
+      lbuf_puts(b, "<chan>");
+      break;
+
+    case LVAL_SEQ:
+      lbuf_puts(b, "<seq>");
+      break;
+
+    /* Lists are lval_write's */
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      break;
+  }
+}
+
+/* A list being written, and the next of its cells */
+typedef struct {
+  lval* v;
+  int i;
+} lwrite_frame;
+
+/* Write an "lval" into an output buffer. Lists are walked on a stack of
+   their own, so anything read can be printed */
+void lval_write(lbuf* b, lval* v) {
+  lwrite_frame* stack = NULL;
+  int count = 0, slots = 0;
+
+  for (;;) {
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+      lbuf_putc(b, v->type == LVAL_SEXPR ? '(' : '{');
+      if (count == slots) {
+        slots = slots ? slots * 2 : 16;
+        stack = realloc(stack, sizeof(lwrite_frame) * slots);
+      }
+      stack[count].v = v;
+      stack[count].i = 0;
+      count++;
+    } else {
+      lval_write_atom(b, v);
+    }
+
+    /* Close finished lists, then move on to the next cell */
+    while (count && stack[count - 1].i == stack[count - 1].v->count) {
+      count--;
+      lbuf_putc(b, stack[count].v->type == LVAL_SEXPR ? ')' : '}');
+    }
+    if (count == 0) { break; }
+
+    lwrite_frame* f = &stack[count - 1];
+    if (f->i) { lbuf_putc(b, ' '); }
+    v = f->v->cell[f->i++];
+  }
+
+  free(stack);
+}
+
+/* Print an "lval" */
+void lval_print(lval* v) {
+  lbuf b = lbuf_new(stdout, -1);
+  lval_write(&b, v);
+  lbuf_del(&b);
+}
+lenv* lenv_copy(lenv* e) {
+  lenv* n = malloc(sizeof(lenv));
+  n->par = e->par;
+  n->map = ltrie_retain(e->map);
+  n->count = e->count;
+  n->syms = malloc(sizeof(char*) * n->count);
+  n->vals = malloc(sizeof(lval*) * n->count);
+  for (int i = 0; i < e->count; i++) {
+    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
+    strcpy(n->syms[i], e->syms[i]);
+    n->vals[i] = lval_copy(e->vals[i]);
+  }
+  return n;
+}
+
+/* Copy and lval */
+lval* lval_copy(lval* v) {
+  lval* x = lval_alloc(v->type);
+  stats.copies++;
+
+  switch (v->type) {
+    case LVAL_BOOL:
+      x->boolean = v->boolean;
+      break;
+    case LVAL_NUM: 
+      x->num = v->num; 
+      break;
+    case LVAL_STR:
+      x->string = malloc(strlen(v->string) + 1);
+      strcpy(x->string, v->string);
+      stats.alloc_bytes += strlen(v->string) + 1;
+      break;
+    case LVAL_FUN:
+      x->name = v->name;
+      x->memo = v->memo;
+      if (x->memo) { lmemo_retain(x->memo); }
+      if (v->builtin != NULL) {
+        x->builtin = v->builtin;
+      } else {
+        x->builtin = NULL;
+        x->env = lenv_copy(v->env);
+        x->formals = lval_copy(v->formals);
+        x->body = lval_copy(v->body);
+      }
+      break;
+    case LVAL_ERR:
+      x->err = malloc(strlen(v->err) + 1);
+      strcpy(x->err, v->err);
+      stats.alloc_bytes += strlen(v->err) + 1;
+      break;
+    case LVAL_SYM:
+      x->sym = malloc(strlen(v->sym) + 1);
+      strcpy(x->sym, v->sym);
+      stats.alloc_bytes += strlen(v->sym) + 1;
+      break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      x->count = v->count;
+      x->cell = malloc(sizeof(lval*) * x->count);
+      for (int i = 0; i != v->count; ++i) {
+        x->cell[i] = lval_copy(v->cell[i]);
+      }
+      break;
+    case LVAL_FUTURE:
+      x->future = v->future;
+      lfuture_retain(x->future);
+      break;
+    case LVAL_CHAN:
+      x->chan = v->chan;
+      lchan_retain(x->chan);
+      break;
+    case LVAL_SEQ:
+      x->seq = v->seq;
+      lseq_retain(x->seq);
+      break;
+  }
+
+  return x;
+}
+
+/* Print an lval followed by a newline */
+void lval_println(lval* v) {
+  lbuf b = lbuf_new(stdout, -1);
+  lval_write(&b, v);
+  lbuf_putc(&b, '\n');
+  lbuf_del(&b);
+}
+
+lval* lval_pop(lval* v, int i) {
+  /* Find the item at "i" */
+  lval* x = v->cell[i];
+
+  /* Shift memory after the item at "i" over the top */
+  memmove(&v->cell[i], &v->cell[i+1],
+    sizeof(lval*) * (v->count-i-1));
+
+  /* Decrease the count of items in the list */
+  v->count--;
+
+  /* Reallocate the memory used */
+  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  return x;
+}
+
+lval* lval_take(lval* v, int i) {
+  lval* x = lval_pop(v, i);
+  lval_del(v);
+  return x;
+}
+
+lval* builtin_op(linterp* l, lenv* e, lval* a, char* op) {
+  for (int i = 0; i != a->count; ++i) {
+    if (a->cell[i]->type != LVAL_NUM) {
+      lval_del(a);
+      return lval_err("Cannot operate on a non-number!");
+    }
+  }
+
+  lval* x = lval_pop(a, 0);
+
+  /* If no arguments and sub then perform unary negation */
+  if ((strcmp(op, "-") == 0) && a->count == 0) {
+    x->num = -x->num;
+  }
+
+  while (a->count != 0) {
+    lval* y = lval_pop(a, 0);
+
+    if (strcmp(op, "+") == 0)  x->num += y->num;
+    if (strcmp(op, "-") == 0)  x->num -= y->num;
+    if (strcmp(op, "*") == 0)  x->num *= y->num;
+    if (strcmp(op, "/") == 0) {
+      if (y->num == 0) {
+        lval_del(x); lval_del(y);
+        x = lval_err("Can't divide by 0");
+        break;
+      }
+      x->num /= y->num;
+    }
+    if (strcmp(op, "%") == 0) x->num %= y->num;
+    if (strcmp(op, "^") == 0) x->num = lpow(x->num, y->num);
+
+    lval_del(y);
+  }
+  
+  lval_del(a);
+  return x;
+}
+
+/* Parses length bytes of string, or the file's contents if string is NULL,
+   counting the time it takes */
+int lispy_parse(linterp* l, const char* filename, const char* string,
+  size_t length, mpc_result_t* r) {
+  long start = stats_clock();
+  int ok = string
+    ? mpc_nparse(filename, string, length, l->Lispy, r)
+    : mpc_parse_contents(filename, l->Lispy, r);
+  stats.parses++;
+  stats.parse_usec += stats_clock() - start;
+  return ok;
+}
+
+/* Parses a whole file. Safe to call from any thread */
+lval* lval_read_file(linterp* l, char* filename) {
+  mpc_result_t r;
+  if (lispy_parse(l, filename, NULL, 0, &r)) {
+    lval* expr = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    return expr;
+  }
+
+  char* err_msg = mpc_err_string(r.error);
+  mpc_err_delete(r.error);
+
+  lval* err = lval_err("Could not load Libarry %s", err_msg);
+  free(err_msg);
+
+  return err;
+}
+
+/* The part of a file's mtime finer than a second, where the system keeps
+   it, so a file rewritten within the same second still looks changed */
+static long stat_mtime_nsec(struct stat* st) {
+#if defined(_WIN32)
+  return 0;
+#elif defined(__APPLE__)
+  /* What st_mtimespec is called with _POSIX_C_SOURCE defined */
+  return st->st_mtimensec;
+#else
+  return st->st_mtim.tv_nsec;
+#endif
+}
+
+/* Finds the entry for a file, emptying it if the file has changed since it
+   was filled. Returns NULL if the file can't be cached */
+load_entry* load_cache_lookup(linterp* l, char* path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    l->load_cache.misses++;
+    return NULL;
+  }
+
+  load_entry* entry = l->load_cache.entries;
+  while (entry && strcmp(entry->path, path) != 0) { entry = entry->next; }
+
+  if (entry == NULL) {
+    entry = malloc(sizeof(load_entry));
+    entry->path = malloc(strlen(path) + 1);
+    strcpy(entry->path, path);
+    entry->forms = NULL;
+    entry->next = l->load_cache.entries;
+    l->load_cache.entries = entry;
+  }
+
+  long nsec = stat_mtime_nsec(&st);
+  if (entry->forms && (entry->mtime != st.st_mtime
+      || entry->mtime_nsec != nsec || entry->size != st.st_size)) {
+    lval_del(entry->forms);
+    entry->forms = NULL;
+  }
+
+  entry->mtime = st.st_mtime;
+  entry->mtime_nsec = nsec;
+  entry->size = st.st_size;
+
+  if (entry->forms) { l->load_cache.hits++; } else { l->load_cache.misses++; }
+  return entry;
+}
+
+/* Keeps a copy of a freshly read file in its entry, unless reading failed */
+void load_cache_store(load_entry* entry, lval* expr) {
+  if (entry == NULL || expr->type == LVAL_ERR) { return; }
+  if (entry->forms) { lval_del(entry->forms); }
+  entry->forms = lval_copy(expr);
+}
+
+/* Empties every entry. Entries themselves live until load_cache_free, as
+   load_files holds on to them while files are evaluated */
+void load_cache_clear(linterp* l) {
+  for (load_entry* entry = l->load_cache.entries; entry; entry = entry->next) {
+    if (entry->forms) { lval_del(entry->forms); }
+    entry->forms = NULL;
+  }
+}
+
+void load_cache_free(linterp* l) {
+  load_cache_clear(l);
+  while (l->load_cache.entries) {
+    load_entry* entry = l->load_cache.entries;
+    l->load_cache.entries = entry->next;
+    free(entry->path);
+    free(entry);
+  }
+}
+
+/* lval_read_file through the cache, only for the thread running l */
+lval* lval_read_cached(linterp* l, char* filename) {
+  load_entry* entry = load_cache_lookup(l, filename);
+  if (entry && entry->forms) { return lval_copy(entry->forms); }
+
+  lval* expr = lval_read_file(l, filename);
+  load_cache_store(entry, expr);
+  return expr;
+}
+
+void builtin_register(linterp* l, char* name, lbuiltin func) {
+  for (int i = 0; i != l->builtins.count; ++i) {
+    if (strcmp(l->builtins.names[i], name) == 0) { l->builtins.funcs[i] = func; return; }
+  }
+  l->builtins.count++;
+  l->builtins.names = realloc(l->builtins.names, sizeof(char*) * l->builtins.count);
+  l->builtins.funcs = realloc(l->builtins.funcs, sizeof(lbuiltin) * l->builtins.count);
+  l->builtins.names[l->builtins.count-1] = name;
+  l->builtins.funcs[l->builtins.count-1] = func;
+}
+
+char* builtin_name(linterp* l, lbuiltin func) {
+  for (int i = 0; i != l->builtins.count; ++i) {
+    if (l->builtins.funcs[i] == func) { return l->builtins.names[i]; }
+  }
+  return NULL;
+}
+
+lbuiltin builtin_find(linterp* l, char* name) {
+  for (int i = 0; i != l->builtins.count; ++i) {
+    if (strcmp(l->builtins.names[i], name) == 0) { return l->builtins.funcs[i]; }
+  }
+  return NULL;
+}
+
+char* lval_name_intern(linterp* c, char* name) {
+  linterp* l = linterp_root(c);
+  lspin_lock(&l->lock);
+  if (l->names.count * 2 >= l->names.cap) {
+    size_t cap = l->names.cap ? l->names.cap * 2 : 256;
+    char** slots = calloc(cap, sizeof(char*));
+    for (size_t i = 0; i != l->names.cap; ++i) {
+      if (!l->names.slots[i]) { continue; }
+      size_t j = hash_string(l->names.slots[i]) & (cap - 1);
+      while (slots[j]) { j = (j + 1) & (cap - 1); }
+      slots[j] = l->names.slots[i];
+    }
+    free(l->names.slots);
+    l->names.slots = slots;
+    l->names.cap = cap;
+  }
+
+  size_t j = hash_string(name) & (l->names.cap - 1);
+  while (l->names.slots[j]) {
+    if (strcmp(l->names.slots[j], name) == 0) { break; }
+    j = (j + 1) & (l->names.cap - 1);
+  }
+  if (!l->names.slots[j]) {
+    l->names.slots[j] = malloc(strlen(name) + 1);
+    strcpy(l->names.slots[j], name);
+    l->names.count++;
+  }
+  char* interned = l->names.slots[j];
+  lspin_unlock(&l->lock);
+  return interned;
+}
+
+void lval_names_free(linterp* l) {
+  for (size_t i = 0; i != l->names.cap; ++i) { free(l->names.slots[i]); }
+  free(l->names.slots);
+}
+
+/* Sampling profiler. lval_eval_sexpr keeps the functions being called on
+   each interpreter's call stack, and while profiling a SIGPROF timer
+   copies the innermost PROF_DEPTH of the profiled interpreter's into a
+   sample buffer. Samples are written out as collapsed stacks for flame
+   graphs. There's one timer per process, so one interpreter at a time
+   can be profiled */
+struct {
+  linterp* volatile target;
+  volatile sig_atomic_t on;
+  prof_frame* frames;
+  int* lens;
+  size_t used;
+  long samples;
+  long dropped;
+} prof;
+
+prof_frame prof_push(linterp* l, lval* f) {
+  int i = l->depth & (PROF_DEPTH - 1);
+  prof_frame replaced = l->calls[i];
+  l->calls[i].builtin = f->builtin;
+  l->calls[i].name = f->name;
+  l->depth++;
+  return replaced;
+}
+
+void prof_pop(linterp* l, prof_frame replaced) {
+  l->depth--;
+  l->calls[l->depth & (PROF_DEPTH - 1)] = replaced;
+}
+
+void prof_sample(int sig) {
+  linterp* l = prof.target;
+  if (!prof.on || !l) { return; }
+
+  int depth = l->depth;
+  int n = depth < PROF_DEPTH ? depth : PROF_DEPTH;
+  if (prof.samples == PROF_SAMPLES || prof.used + n > PROF_FRAMES) {
+    prof.dropped++;
+    return;
+  }
+
+  for (int i = depth - n; i != depth; ++i) {
+    prof.frames[prof.used++] = l->calls[i & (PROF_DEPTH - 1)];
+  }
+  prof.lens[prof.samples++] = n;
+}
+
+int prof_strcmp(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Writes each distinct stack with the number of samples it was seen in */
+void prof_write(linterp* l, lbuf* out) {
+  char** stacks = malloc(sizeof(char*) * (prof.samples ? prof.samples : 1));
+  prof_frame* frame = prof.frames;
+
+  for (long i = 0; i != prof.samples; ++i) {
+    lbuf b = lbuf_new(NULL, -1);
+    if (prof.lens[i] == 0) { lbuf_puts(&b, "toplevel"); }
+    for (int j = 0; j != prof.lens[i]; ++j, ++frame) {
+      char* name = frame->builtin ? builtin_name(l, frame->builtin) : frame->name;
+      if (j) { lbuf_putc(&b, ';'); }
+      lbuf_puts(&b, name ? name : frame->builtin ? "builtin" : "lambda");
+    }
+    stacks[i] = lbuf_take(&b);
+  }
+
+  qsort(stacks, prof.samples, sizeof(char*), prof_strcmp);
+
+  for (long i = 0; i != prof.samples;) {
+    long j = i;
+    while (j != prof.samples && strcmp(stacks[i], stacks[j]) == 0) { ++j; }
+    lbuf_puts(out, stacks[i]);
+    lbuf_putc(out, ' ');
+    lbuf_put_long(out, j - i);
+    lbuf_putc(out, '\n');
+    while (i != j) { free(stacks[i++]); }
+  }
+  free(stacks);
+}
+
+void prof_free(void) {
+  prof.on = 0;
+  prof.target = NULL;
+  free(prof.frames);
+  free(prof.lens);
+  prof.frames = NULL;
+  prof.lens = NULL;
+}
+
+/* Binary form of lvals, read and written by load, dump, undump and images.
+   A file is a magic number then a run of values, each a tag byte followed
+   by its payload. Numbers are zigzag varints, strings are a varint length
+   then the bytes. A symbol's text is written the first time it appears and
+   after that only its index. Expressions are a varint count then the
+   children. Builtins are stored by name, lambdas as their formals, body and
+   environment, and an environment as a varint count then name and value
+   pairs. Files are mapped rather than read and decoded one top level value
+   at a time, so they can be bigger than memory as long as each value fits. */
+#define LBIN_MAGIC "CLB\001"
+#define LBIN_IMAGE_MAGIC "CLI\001"
+#define LBIN_EXT ".clispb"
+
+enum { LBIN_NUM = 1, LBIN_TRUE, LBIN_FALSE, LBIN_STR, LBIN_ERR,
+       LBIN_SYM, LBIN_SYM_REF, LBIN_SEXPR, LBIN_QEXPR,
+       LBIN_BUILTIN, LBIN_LAMBDA };
+
+typedef struct {
+  linterp* l;
+  FILE* f;
+  /* Open addressed table of symbols written so far, and their indices */
+  int count;
+  int slots;
+  char** syms;
+  int* index;
+} lbin_writer;
+
+typedef struct {
+  linterp* l;
+  const unsigned char* data;
+  const unsigned char* p;
+  const unsigned char* end;
+  size_t length;
+  int corrupt;
+  /* Set with corrupt when values nest past read_depth_max */
+  int deep;
+  int depth;
+  int count;
+  int slots;
+  char** syms;
+} lbin_reader;
+
+int lbin_is_binary(char* filename) {
+  size_t n = strlen(filename), m = strlen(LBIN_EXT);
+  return n >= m && strcmp(filename + n - m, LBIN_EXT) == 0;
+}
+
+static void lbin_put_varint(FILE* f, unsigned long x) {
+  while (x >= 0x80) {
+    putc((int)(x & 0x7F) | 0x80, f);
+    x >>= 7;
+  }
+  putc((int)x, f);
+}
+
+static void lbin_put_bytes(FILE* f, char* s) {
+  size_t n = strlen(s);
+  lbin_put_varint(f, n);
+  fwrite(s, 1, n, f);
+}
+
+/* Returns the index a symbol was given, or -1 after adding it to the table */
+static int lbin_writer_sym(lbin_writer* w, char* sym) {
+  if (w->count * 2 >= w->slots) {
+    int slots = w->slots ? w->slots * 2 : 64;
+    char** syms = calloc(slots, sizeof(char*));
+    int* index = malloc(sizeof(int) * slots);
+    for (int i = 0; i != w->slots; ++i) {
+      if (w->syms[i] == NULL) { continue; }
+      unsigned long j = hash_string(w->syms[i]) & (slots - 1);
+      while (syms[j]) { j = (j + 1) & (slots - 1); }
+      syms[j] = w->syms[i];
+      index[j] = w->index[i];
+    }
+    free(w->syms);
+    free(w->index);
+    w->syms = syms;
+    w->index = index;
+    w->slots = slots;
+  }
+
+  unsigned long j = hash_string(sym) & (w->slots - 1);
+  while (w->syms[j]) {
+    if (strcmp(w->syms[j], sym) == 0) { return w->index[j]; }
+    j = (j + 1) & (w->slots - 1);
+  }
+
+  w->syms[j] = malloc(strlen(sym) + 1);
+  strcpy(w->syms[j], sym);
+  w->index[j] = w->count++;
+  return -1;
+}
+
+lval* lbin_write(lbin_writer* w, lval* v);
+
+static lval* lbin_write_binding(void* w, char* sym, lval* v) {
+  lbin_put_bytes(((lbin_writer*)w)->f, sym);
+  return lbin_write(w, v);
+}
+
+lval* lbin_write_env(lbin_writer* w, lenv* e) {
+  if (e->map) {
+    lbin_put_varint(w->f, ltrie_count(e->map));
+    return ltrie_each(e->map, lbin_write_binding, w);
+  }
+  lbin_put_varint(w->f, e->count);
+  for (int i = 0; i != e->count; ++i) {
+    lval* err = lbin_write_binding(w, e->syms[i], e->vals[i]);
+    if (err) { return err; }
+  }
+  return NULL;
+}
+
+/* Writes v, except that a list only gets its tag and count, for
+   lbin_write to write the cells after */
+static lval* lbin_write_one(lbin_writer* w, lval* v) {
+  switch (v->type) {
+    case LVAL_NUM: {
+      unsigned long n = (unsigned long)v->num;
+      putc(LBIN_NUM, w->f);
+      lbin_put_varint(w->f, v->num < 0 ? ~(n << 1) : n << 1);
+      break;
+    }
+    case LVAL_BOOL:
+      putc(v->boolean ? LBIN_TRUE : LBIN_FALSE, w->f);
+      break;
+    case LVAL_STR:
+      putc(LBIN_STR, w->f);
+      lbin_put_bytes(w->f, v->string);
+      break;
+    case LVAL_ERR:
+      putc(LBIN_ERR, w->f);
+      lbin_put_bytes(w->f, v->err);
+      break;
+    case LVAL_SYM: {
+      int i = lbin_writer_sym(w, v->sym);
+      if (i < 0) {
+        putc(LBIN_SYM, w->f);
+        lbin_put_bytes(w->f, v->sym);
+      } else {
+        putc(LBIN_SYM_REF, w->f);
+        lbin_put_varint(w->f, i);
+      }
+      break;
+    }
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      putc(v->type == LVAL_SEXPR ? LBIN_SEXPR : LBIN_QEXPR, w->f);
+      lbin_put_varint(w->f, v->count);
+      break;
+    case LVAL_FUN:
+      if (v->builtin) {
+        char* name = builtin_name(w->l, v->builtin);
+        if (name == NULL) { return lval_err("Can't dump an unregistered builtin!"); }
+        putc(LBIN_BUILTIN, w->f);
+        lbin_put_bytes(w->f, name);
+        break;
+      }
+      putc(LBIN_LAMBDA, w->f);
+      lval* err = lbin_write(w, v->formals);
+      if (!err) { err = lbin_write(w, v->body); }
+      if (!err) { err = lbin_write_env(w, v->env); }
+      if (err) { return err; }
+      break;
+    case LVAL_FUTURE:
+      return lval_err("Can't dump a future, await it first!");
+    case LVAL_CHAN:
+      return lval_err("Can't dump a channel!");
+    case LVAL_SEQ:
+      return lval_err("Can't dump a sequence, collect it first!");
+  }
+  return NULL;
+}
+
+/* Returns an error if v holds something without a binary form. Lists are
+   walked on a stack of their own, so anything read can be written */
+lval* lbin_write(lbin_writer* w, lval* v) {
+  lwrite_frame* stack = NULL;
+  int count = 0, slots = 0;
+  lval* err;
+
+  for (;;) {
+    if ((err = lbin_write_one(w, v))) { break; }
+    if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->count) {
+      if (count == slots) {
+        slots = slots ? slots * 2 : 16;
+        stack = realloc(stack, sizeof(lwrite_frame) * slots);
+      }
+      stack[count].v = v;
+      stack[count].i = 0;
+      count++;
+    }
+
+    while (count && stack[count - 1].i == stack[count - 1].v->count) { count--; }
+    if (count == 0) { break; }
+    v = stack[count - 1].v->cell[stack[count - 1].i++];
+  }
+
+  free(stack);
+  return err;
+}
+
+void lbin_writer_del(lbin_writer* w) {
+  for (int i = 0; i != w->slots; ++i) { free(w->syms[i]); }
+  free(w->syms);
+  free(w->index);
+}
+
+static int lbin_get_varint(lbin_reader* r, unsigned long* x) {
+  *x = 0;
+  for (int shift = 0; shift < (int)sizeof(unsigned long) * 8; shift += 7) {
+    if (r->p == r->end) { return 0; }
+    int c = *r->p++;
+    *x |= (unsigned long)(c & 0x7F) << shift;
+    if (!(c & 0x80)) { return 1; }
+  }
+  return 0;
+}
+
+/* Reads a length prefixed string, NULL if it's cut short */
+static char* lbin_get_bytes(lbin_reader* r) {
+  unsigned long n;
+  if (!lbin_get_varint(r, &n) || n > (unsigned long)(r->end - r->p)) { return NULL; }
+  if (memchr(r->p, '\0', n)) { return NULL; }
+
+  char* s = malloc(n + 1);
+  memcpy(s, r->p, n);
+  s[n] = '\0';
+  r->p += n;
+  return s;
+}
+
+lval* lbin_read(lbin_reader* r);
+
+/* Reads name and value pairs into e. Names already in the first 'check'
+   entries of e are replaced, the rest are added without looking */
+int lbin_read_env(lbin_reader* r, lenv* e, int check) {
+  unsigned long n;
+  if (!lbin_get_varint(r, &n) || n > (unsigned long)(r->end - r->p)) { return 0; }
+
+  if (!e->map) {
+    e->syms = realloc(e->syms, sizeof(char*) * (e->count + n));
+    e->vals = realloc(e->vals, sizeof(lval*) * (e->count + n));
+  }
+
+  for (unsigned long i = 0; i != n; ++i) {
+    char* sym = lbin_get_bytes(r);
+    if (sym == NULL) { return 0; }
+    lval* v = lbin_read(r);
+    if (v == NULL) { free(sym); return 0; }
+    if (!e->par && v->type == LVAL_FUN && !v->builtin) {
+      v->name = lval_name_intern(r->l, sym);
+    }
+    if (e->map) {
+      lenv_bind(e, sym, v);
+      free(sym);
+      continue;
+    }
+
+    int j = 0;
+    while (j != check && strcmp(e->syms[j], sym) != 0) { ++j; }
+    if (j != check) {
+      free(sym);
+      lval_del(e->vals[j]);
+      e->vals[j] = v;
+    } else {
+      e->syms[e->count] = sym;
+      e->vals[e->count] = v;
+      e->count++;
+    }
+  }
+  return 1;
+}
+
+/* Lambdas are still read recursively, through their formals, body and
+   environment, so each counts as this many levels against read_depth_max */
+enum { LBIN_LAMBDA_LEVELS = 8 };
+
+/* Reads one value, except that a list comes back empty with its length in
+   *n for lbin_read to fill. NULL, setting 'corrupt', if it can't */
+static lval* lbin_read_one(lbin_reader* r, unsigned long* n) {
+  int tag = *r->p++;
+  char* s;
+  lval* v;
+
+  *n = 0;
+  switch (tag) {
+    case LBIN_NUM:
+      if (!lbin_get_varint(r, n)) { break; }
+      v = lval_num((long)((*n >> 1) ^ (0UL - (*n & 1))));
+      *n = 0;
+      return v;
+    case LBIN_TRUE:  return lval_bool(true);
+    case LBIN_FALSE: return lval_bool(false);
+    case LBIN_STR:
+    case LBIN_ERR:
+      if ((s = lbin_get_bytes(r)) == NULL) { break; }
+      v = tag == LBIN_STR ? lval_str(s) : lval_err("%s", s);
+      free(s);
+      return v;
+    case LBIN_SYM:
+      if ((s = lbin_get_bytes(r)) == NULL) { break; }
+      if (r->count == r->slots) {
+        r->slots = r->slots ? r->slots * 2 : 64;
+        r->syms = realloc(r->syms, sizeof(char*) * r->slots);
+      }
+      r->syms[r->count++] = s;
+      return lval_sym(s);
+    case LBIN_SYM_REF:
+      if (!lbin_get_varint(r, n) || *n >= (unsigned long)r->count) { break; }
+      v = lval_sym(r->syms[*n]);
+      *n = 0;
+      return v;
+    case LBIN_SEXPR:
+    case LBIN_QEXPR:
+      if (!lbin_get_varint(r, n)) { break; }
+      return tag == LBIN_SEXPR ? lval_sexpr() : lval_qexpr();
+    case LBIN_BUILTIN: {
+      if ((s = lbin_get_bytes(r)) == NULL) { break; }
+      lbuiltin func = builtin_find(r->l, s);
+      free(s);
+      if (func == NULL) { break; }
+      return lval_fun(func);
+    }
+    case LBIN_LAMBDA: {
+      if (read_depth_max && r->depth > read_depth_max - LBIN_LAMBDA_LEVELS) {
+        r->deep = 1;
+        break;
+      }
+      r->depth += LBIN_LAMBDA_LEVELS;
+      lval* formals = lbin_read(r);
+      lval* body = formals ? lbin_read(r) : NULL;
+      if (body == NULL || formals->type != LVAL_QEXPR || body->type != LVAL_QEXPR) {
+        r->depth -= LBIN_LAMBDA_LEVELS;
+        if (formals) { lval_del(formals); }
+        if (body) { lval_del(body); }
+        break;
+      }
+      v = lval_lambda(formals, body);
+      bool read = lbin_read_env(r, v->env, 0);
+      r->depth -= LBIN_LAMBDA_LEVELS;
+      if (!read) {
+        lval_del(v);
+        break;
+      }
+      return v;
+    }
+  }
+
+  *n = 0;
+  r->corrupt = 1;
+  return NULL;
+}
+
+/* A list being read, and how many more values it holds */
+typedef struct {
+  lval* v;
+  unsigned long left;
+} lbin_frame;
+
+/* Reads the next value. Returns NULL at the end of the file, or if the
+   file is corrupt, which sets 'corrupt'. Lists are filled on a stack of
+   their own, so their nesting is limited only by read_depth_max */
+lval* lbin_read(lbin_reader* r) {
+  if (r->p == r->end) { return NULL; }
+
+  lbin_frame* stack = NULL;
+  int count = 0, slots = 0;
+  unsigned long n;
+  lval* v = lbin_read_one(r, &n);
+
+  while (v) {
+    if (n) {
+      if (read_depth_max && r->depth >= read_depth_max) {
+        r->deep = 1;
+        r->corrupt = 1;
+        lval_del(v);
+        v = NULL;
+        break;
+      }
+      if (count == slots) {
+        slots = slots ? slots * 2 : 16;
+        stack = realloc(stack, sizeof(lbin_frame) * slots);
+      }
+      stack[count].v = v;
+      stack[count].left = n;
+      count++;
+      r->depth++;
+    } else {
+      if (count == 0) { break; }
+      lbin_frame* f = &stack[count - 1];
+      lval_add(f->v, v);
+      if (--f->left == 0) {
+        v = f->v;
+        count--;
+        r->depth--;
+        continue;
+      }
+    }
+
+    /* A list cut short */
+    if (r->p == r->end) {
+      r->corrupt = 1;
+      v = NULL;
+      break;
+    }
+    v = lbin_read_one(r, &n);
+  }
+
+  if (v == NULL) {
+    while (count) {
+      lval_del(stack[--count].v);
+      r->depth--;
+    }
+  }
+  free(stack);
+  return v;
+}
+
+void lbin_reader_close(lbin_reader* r) {
+  for (int i = 0; i != r->count; ++i) { free(r->syms[i]); }
+  free(r->syms);
+#ifdef _WIN32
+  free((void*)r->data);
+#else
+  if (r->data) { munmap((void*)r->data, r->length); }
+#endif
+}
+
+/* Maps a file for lbin_read, returning an error if it doesn't start with
+   the given magic number */
+lval* lbin_reader_open(linterp* l, lbin_reader* r, char* filename,
+  const char* magic) {
+  r->l = l;
+  r->corrupt = 0;
+  r->deep = 0;
+  r->depth = 0;
+  r->count = 0;
+  r->slots = 0;
+  r->syms = NULL;
+  r->data = NULL;
+  r->length = 0;
+
+#ifdef _WIN32
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) { return lval_err("Unable to open file '%s'!", filename); }
+  unsigned char* data = NULL;
+  size_t size = 0, got;
+  do {
+    data = realloc(data, size + 65536);
+    got = fread(data + size, 1, 65536, f);
+    size += got;
+  } while (got == 65536);
+  fclose(f);
+  r->data = data;
+  r->length = size;
+#else
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0) { close(fd); }
+    return lval_err("Unable to open file '%s'!", filename);
+  }
+  r->length = st.st_size;
+  if (r->length) {
+    void* data = mmap(NULL, r->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    r->data = data == MAP_FAILED ? NULL : data;
+  }
+  close(fd);
+  if (r->length && r->data == NULL) {
+    return lval_err("Unable to map file '%s'!", filename);
+  }
+#endif
+
+  r->p = r->data;
+  r->end = r->data + r->length;
+
+  if (r->length < 4 || memcmp(r->data, magic, 4) != 0) {
+    lbin_reader_close(r);
+    return lval_err("'%s' isn't a CLispy %s!", filename,
+      strcmp(magic, LBIN_MAGIC) == 0 ? "binary file" : "image");
+  }
+  r->p += 4;
+
+  return NULL;
+}
+
+
+/* The error for a reader which stopped early, 'what' naming the file */
+static lval* lbin_reader_err(lbin_reader* r, const char* what,
+  const char* filename) {
+  if (r->deep) { return lval_err("'%s' is nested too deeply!", filename); }
+  return lval_err("Corrupt %s '%s'!", what, filename);
+}
+
+/* Evaluates each expression of a file read by lval_read_file */
+lval* lval_load(linterp* l, lenv* e, lval* expr) {
+  if (expr->type == LVAL_ERR) { return expr; }
+
+  while (expr->count) {
+    lval* x = lval_eval(l, e, lval_pop(expr, 0));
+
+    if (x->type == LVAL_ERR) {
+      lval_println(x);
+    }
+    lval_del(x);
+  }
+
+  lval_del(expr);
+  return lval_sexpr();
+}
+
+/* Evaluates each value of a binary file as it's read. Q-Expressions are
+   run the way eval runs them, so code can be dumped quoted */
+lval* lval_load_binary(linterp* l, lenv* e, char* filename) {
+  lbin_reader r;
+  lval* err = lbin_reader_open(l, &r, filename, LBIN_MAGIC);
+  if (err) { return err; }
+
+  lval* v;
+  while ((v = lbin_read(&r))) {
+    if (v->type == LVAL_QEXPR) { v->type = LVAL_SEXPR; }
+    lval* x = lval_eval(l, e, v);
+
+    if (x->type == LVAL_ERR) {
+      lval_println(x);
+    }
+    lval_del(x);
+  }
+
+  err = r.corrupt ? lbin_reader_err(&r, "binary file", filename) : NULL;
+  lbin_reader_close(&r);
+  return err ? err : lval_sexpr();
+}
+
+lval* builtin_load(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'load' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_STR, "'load' expects a string.");
+
+  if (lbin_is_binary(a->cell[0]->string)) {
+    lval* x = lval_load_binary(l, e, a->cell[0]->string);
+    lval_del(a);
+    return x;
+  }
+
+  lval* expr = lval_read_cached(l, a->cell[0]->string);
+  lval_del(a);
+
+  return lval_load(l, e, expr);
+}
+
+/* (dump "file.clispb" v ...) writes the values in binary, for undump, or
+   for load if they're quoted code */
+lval* builtin_dump(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1, "'dump' expects at least 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_STR, "'dump' expects a file name.");
+
+  char* filename = a->cell[0]->string;
+  lbin_writer w = { l, fopen(filename, "wb"), 0, 0, NULL, NULL };
+  if (w.f == NULL) {
+    lval* err = lval_err("Unable to open file '%s'!", filename);
+    lval_del(a);
+    return err;
+  }
+
+  fwrite(LBIN_MAGIC, 1, 4, w.f);
+  lval* err = NULL;
+  for (int i = 1; i != a->count && err == NULL; ++i) {
+    err = lbin_write(&w, a->cell[i]);
+  }
+  lbin_writer_del(&w);
+
+  /* Failed putc and fwrite calls only show in the error flag */
+  bool failed = ferror(w.f) != 0;
+  if ((fclose(w.f) != 0 || failed) && err == NULL) {
+    err = lval_err("Unable to write file '%s'!", filename);
+  }
+  /* Don't leave half a file behind */
+  if (err) { remove(filename); }
+
+  lval_del(a);
+  return err ? err : lval_sexpr();
+}
+
+/* (save-image "file") writes the global environment, for --image */
+lval* builtin_save_image(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'save-image' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_STR, "'save-image' expects a file name.");
+
+  while (e->par) { e = e->par; }
+
+  char* filename = a->cell[0]->string;
+  lbin_writer w = { l, fopen(filename, "wb"), 0, 0, NULL, NULL };
+  if (w.f == NULL) {
+    lval* err = lval_err("Unable to open file '%s'!", filename);
+    lval_del(a);
+    return err;
+  }
+
+  fwrite(LBIN_IMAGE_MAGIC, 1, 4, w.f);
+  lval* err = lbin_write_env(&w, e);
+  lbin_writer_del(&w);
+
+  bool failed = ferror(w.f) != 0;
+  if ((fclose(w.f) != 0 || failed) && err == NULL) {
+    err = lval_err("Unable to write file '%s'!", filename);
+  }
+  if (err) { remove(filename); }
+
+  lval_del(a);
+  return err ? err : lval_sexpr();
+}
+
+/* Restores an environment written by save-image on top of e */
+lval* lenv_load_image(linterp* l, lenv* e, char* filename) {
+  lbin_reader r;
+  lval* err = lbin_reader_open(l, &r, filename, LBIN_IMAGE_MAGIC);
+  if (err) { return err; }
+
+  if (!lbin_read_env(&r, e, e->count) || r.p != r.end) {
+    err = lbin_reader_err(&r, "image", filename);
+  }
+  lbin_reader_close(&r);
+  return err;
+}
+
+/* (undump "file.clispb") returns the values in the file as a Q-Expression */
+lval* builtin_undump(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'undump' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_STR, "'undump' expects a file name.");
+
+  lbin_reader r;
+  lval* err = lbin_reader_open(l, &r, a->cell[0]->string, LBIN_MAGIC);
+  if (err) { lval_del(a); return err; }
+
+  lval* x = lval_qexpr();
+  lval* v;
+  while ((v = lbin_read(&r))) { lval_add(x, v); }
+
+  if (r.corrupt) {
+    lval_del(x);
+    x = lbin_reader_err(&r, "binary file", a->cell[0]->string);
+  }
+  lbin_reader_close(&r);
+  lval_del(a);
+  return x;
+}
+
+/* (load-cache-clear ()) forgets every file, (load-cache-clear "path") one */
+lval* builtin_load_cache_clear(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'load-cache-clear' expects 1 argument.");
+
+  if (a->cell[0]->type == LVAL_STR) {
+    for (load_entry* entry = l->load_cache.entries; entry; entry = entry->next) {
+      if (entry->forms && strcmp(entry->path, a->cell[0]->string) == 0) {
+        lval_del(entry->forms);
+        entry->forms = NULL;
+      }
+    }
+  } else {
+    load_cache_clear(l);
+  }
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* (load-cache-stats ()) returns {hits misses} */
+lval* builtin_load_cache_stats(linterp* l, lenv* e, lval* a) {
+  lval_del(a);
+  lval* stats = lval_qexpr();
+  lval_add(stats, lval_num(l->load_cache.hits));
+  lval_add(stats, lval_num(l->load_cache.misses));
+  return stats;
+}
+
+lval* builtin_to_string(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1,
+    "Function 'to-string' passed too many arguments!");
+
+  lbuf b = lbuf_new(NULL, -1);
+  lval_write(&b, a->cell[0]);
+  lval_del(a);
+
+  /* Hand the buffer straight over rather than copying it */
+  lval* v = lval_alloc(LVAL_STR);
+  v->string = lbuf_take(&b);
+  stats.alloc_bytes += strlen(v->string) + 1;
+  return v;
+}
+
+lval* stats_pair(char* name, long x) {
+  lval* pair = lval_qexpr();
+  lval_add(pair, lval_sym(name));
+  lval_add(pair, lval_num(x));
+  return pair;
+}
+
+/* The counters as {{name value} ...}, taken before building the list */
+lval* stats_list(lstats* counters) {
+  static char* type_names[LVAL_TYPES] = {
+    "alloc-num", "alloc-err", "alloc-fun", "alloc-bool",
+    "alloc-str", "alloc-sym", "alloc-sexpr", "alloc-qexpr", "alloc-future",
+    "alloc-chan", "alloc-seq"
+  };
+  lstats s = *counters;
+  long allocs = 0;
+  for (int i = 0; i != LVAL_TYPES; ++i) { allocs += s.allocs[i]; }
+
+  lval* list = lval_qexpr();
+  lval_add(list, stats_pair("allocs", allocs));
+  for (int i = 0; i != LVAL_TYPES; ++i) {
+    lval_add(list, stats_pair(type_names[i], s.allocs[i]));
+  }
+  lval_add(list, stats_pair("alloc-bytes", s.alloc_bytes));
+  lval_add(list, stats_pair("copies", s.copies));
+  lval_add(list, stats_pair("frees", s.frees));
+  lval_add(list, stats_pair("lookups", s.lookups));
+  lval_add(list, stats_pair("lookup-depth", s.lookup_depth));
+  lval_add(list, stats_pair("lookup-depth-max", s.lookup_depth_max));
+  lval_add(list, stats_pair("builtin-calls", s.builtin_calls));
+  lval_add(list, stats_pair("lambda-calls", s.lambda_calls));
+  lval_add(list, stats_pair("parses", s.parses));
+  lval_add(list, stats_pair("parse-usec", s.parse_usec));
+#ifndef _WIN32
+  /* Linux reports kilobytes and macOS bytes */
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  usage.ru_maxrss /= 1024;
+#endif
+  lval_add(list, stats_pair("peak-rss-kb", usage.ru_maxrss));
+#endif
+  return list;
+}
+
+/* (stats ()) returns the counters */
+lval* builtin_stats(linterp* l, lenv* e, lval* a) {
+  lval_del(a);
+  return stats_list(&stats);
+}
+
+/* Writes the counters to stderr, one "name value" per line */
+void stats_print(lstats* counters) {
+  lval* list = stats_list(counters);
+  lbuf b = lbuf_new(stderr, -1);
+  for (int i = 0; i != list->count; ++i) {
+    lval_write(&b, list->cell[i]->cell[0]);
+    lbuf_putc(&b, ' ');
+    lval_write(&b, list->cell[i]->cell[1]);
+    lbuf_putc(&b, '\n');
+  }
+  lbuf_del(&b);
+  lval_del(list);
+}
+
+/* (profile-start ()) samples 1000 times a second of CPU time,
+   (profile-start n) n times a second */
+lval* builtin_profile_start(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'profile-start' expects 1 argument.");
+  long hz = 1000;
+  if (a->cell[0]->type == LVAL_NUM) { hz = a->cell[0]->num; }
+  LASSERT(a, hz > 0 && hz <= 1000000,
+    "'profile-start' rate must be between 1 and 1000000, got %li.", hz);
+  LASSERT(a, !prof.on, "Profiler is already running.");
+  LASSERT(a, !l->root, "'profile-start' can't be used inside pmap, spawn or process.");
+  lval_del(a);
+
+#ifdef _WIN32
+  return lval_err("Profiling is not supported on this platform.");
+#else
+  free(prof.frames);
+  free(prof.lens);
+  prof.frames = malloc(sizeof(prof_frame) * PROF_FRAMES);
+  prof.lens = malloc(sizeof(int) * PROF_SAMPLES);
+  prof.used = 0;
+  prof.samples = 0;
+  prof.dropped = 0;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = prof_sample;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 1 / hz;
+  timer.it_interval.tv_usec = 1000000 / hz % 1000000;
+  timer.it_value = timer.it_interval;
+  prof.target = l;
+  prof.on = 1;
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  return lval_sexpr();
+#endif
+}
+
+/* (profile-stop "file") writes the collapsed stacks to a file,
+   (profile-stop ()) prints them. Returns {samples dropped} */
+lval* builtin_profile_stop(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'profile-stop' expects 1 argument.");
+  LASSERT(a, prof.on && prof.target == l, "Profiler is not running.");
+
+#ifndef _WIN32
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+#endif
+  prof.on = 0;
+
+  FILE* file = stdout;
+  if (a->cell[0]->type == LVAL_STR) {
+    file = fopen(a->cell[0]->string, "w");
+    if (file == NULL) {
+      lval* err = lval_err("Could not open file '%s' for writing.",
+        a->cell[0]->string);
+      lval_del(a);
+      return err;
+    }
+  }
+  lval_del(a);
+
+  lbuf out = lbuf_new(file, -1);
+  prof_write(l, &out);
+  lbuf_del(&out);
+  if (file != stdout) { fclose(file); }
+
+  lval* result = lval_qexpr();
+  lval_add(result, lval_num(prof.samples));
+  lval_add(result, lval_num(prof.dropped));
+  prof_free();
+  return result;
+}
+
+lval* builtin_var(linterp* l, lenv* e, lval* a, char* func) {
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+    "Function 'def' passed incorrect type!");
+  
+  lval* syms = a->cell[0];
+
+  for (int i = 0; i != syms->count; ++i) {
+    LASSERT(a, syms->cell[i]->type == LVAL_SYM,
+      "Function 'def' cannot define non-symbols!");
+  }
+
+  LASSERT(a, syms->count == a->count - 1,
+    "Function 'def' cannot define incorrect number of values to symbols.");
+
+  for (int i = 0; i != syms->count; ++i) {
+    /* Name lambdas after the first symbol they're bound to */
+    lval* v = a->cell[i+1];
+    if (v->type == LVAL_FUN && !v->builtin && !v->name) {
+      v->name = lval_name_intern(l, syms->cell[i]->sym);
+    }
+
+    if (strcmp("def", func) == 0) {
+      lenv_def(e, syms->cell[i], a->cell[i+1]);
+    }
+
+    if (strcmp(func, "=") == 0) {
+      lenv_put(e, syms->cell[i], a->cell[i+1]);
+    }
+  }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_head(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "Function 'head' passed too many arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'head' passed incorrect type!");
+  LASSERT(a, a->cell[0]->count != 0, "Function 'head' passed {}!");
+
+  lval* v = lval_take(a, 0);
+  while (v->count > 1) {
+    lval_del(lval_pop(v, 1));
+  }
+  return v;
+}
+
+lval* builtin_tail(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "Function 'tail' passed too many arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'tail' passed incorrect type!");
+  LASSERT(a, a->cell[0]->count != 0, "Function 'tail' passed {}!");
+
+  lval* v = lval_take(a, 0);
+  lval_del(lval_pop(v,0));
+  return v;
+}
+
+lval* builtin_list(linterp* l, lenv* e, lval* a) {
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+lval* builtin_eval(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1,
+    "Function 'eval' passed too many arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+    "Function 'eval' passed incorrect type!");
+
+  lval* x = lval_take(a, 0);
+  x->type = LVAL_SEXPR;
+  return lval_eval(l, e, x);
+}
+lval* lval_call(linterp* l, lenv* e, lval* f, lval* a) {
+
+  if (f->memo) { return lmemo_call(l, e, f, a); }
+
+  /* If Builtin then simply apply that */
+  if (f->builtin) {
+    stats.builtin_calls++;
+    return f->builtin(l, e, a);
+  }
+  stats.lambda_calls++;
+
+  /* Record Argument Counts */
+  int given = a->count;
+  int total = f->formals->count;
+
+  /* While arguments still remain to be processed */
+  while (a->count) {
+
+    /* If we've ran out of formal arguments to bind */
+    if (f->formals->count == 0) {
+      lval_del(a); return lval_err(
+        "Function passed too many arguments. "
+        "Got %i, Expected %i.", given, total);
+    }
+
+    /* Pop the first symbol from the formals */
+    lval* sym = lval_pop(f->formals, 0);
+
+    if (strcmp(sym->sym, "&") == 0) {
+      if (f->formals->count != 1) {
+        lval_del(a);
+        return lval_err("Function format invalid");
+      }
+
+      lval* nsym = lval_pop(f->formals, 0);
+      lenv_put(f->env, nsym, builtin_list(l, e, a));
+      lval_del(sym);
+      lval_del(nsym);
+      break;
+    }
+
+    /* Pop the next argument from the list */
+    lval* val = lval_pop(a, 0);
+
+    /* Bind a copy into the function's environment */
+    lenv_put(f->env, sym, val);
+
+    /* Delete symbol and value */
+    lval_del(sym); lval_del(val);
+  }
+
+  /* Argument list is now bound so can be cleaned up */
+  lval_del(a);
+
+  /* If '&' remains in formal list bind to empty list */
+  if (f->formals->count > 0 &&
+    strcmp(f->formals->cell[0]->sym, "&") == 0) {
+    
+    /* Check to ensure that & is not passed invalidly. */
+    if (f->formals->count != 2) {
+      return lval_err("Function format invalid. "
+        "Symbol '&' not followed by single symbol.");
+    }
+  
+    /* Pop and delete '&' symbol */
+    lval_del(lval_pop(f->formals, 0));
+  
+    /* Pop next symbol and create empty list */
+    lval* sym = lval_pop(f->formals, 0);
+    lval* val = lval_qexpr();
+  
+    /* Bind to environment and delete */
+    lenv_put(f->env, sym, val);
+    lval_del(sym); lval_del(val);
+  }
+
+  /* If all formals have been bound evaluate */
+  if (f->formals->count == 0) {
+
+    /* Set environment parent to evaluation environment */
+    f->env->par = e;
+
+    /* Evaluate and return */
+    return builtin_eval(l,
+      f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+  } else {
+    /* Otherwise return partially evaluated function */
+    return lval_copy(f);
+  }
+
+}
+
+bool lval_eqv(lval* x, lval* y) {
+  if (x->type != y->type) return false;
+
+  /* Compare Based upon type */
+  switch (x->type) {
+    /* Compare Number Value */
+    case LVAL_NUM: return (x->num == y->num);
+    case LVAL_BOOL: return (x->boolean == y->boolean);
+
+    /* Compare String Values */
+    case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
+    case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
+    case LVAL_STR: return (strcmp(x->string, y->string) == 0);
+
+    /* If builtin compare, otherwise compare formals and body */
+    case LVAL_FUN:
+      if (x->builtin || y->builtin) {
+        return x->builtin == y->builtin;
+      } else {
+        return lval_eqv(x->formals, y->formals)
+          && lval_eqv(x->body, y->body);
+      }
+
+    /* If list compare every individual element */
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      if (x->count != y->count) { return 0; }
+      for (int i = 0; i < x->count; i++) {
+        /* If any element not equal then whole list not equal */
+        if (!lval_eqv(x->cell[i], y->cell[i])) { return 0; }
+      }
+      /* Otherwise lists must be equal */
+      return true;
+    break;
+
+    /* Copies of the same future */
+    case LVAL_FUTURE: return x->future == y->future;
+    /* Copies of the same channel */
+    case LVAL_CHAN: return x->chan == y->chan;
+    /* Copies of the same sequence */
+    case LVAL_SEQ: return x->seq == y->seq;
+  }
+  return false;
+}
+
+/* A hash of v consistent with lval_eqv, so values it finds equal hash the
+   same */
+unsigned long lval_hash(lval* v) {
+  unsigned long h = (unsigned long)v->type * 0x9e3779b97f4a7c15UL;
+  switch (v->type) {
+    case LVAL_NUM: return h ^ ((unsigned long)v->num * 0xff51afd7ed558ccdUL);
+    case LVAL_BOOL: return h ^ v->boolean;
+    case LVAL_ERR: return h ^ hash_string(v->err);
+    case LVAL_SYM: return h ^ hash_string(v->sym);
+    case LVAL_STR: return h ^ hash_string(v->string);
+    case LVAL_FUN:
+      if (v->builtin) { return h ^ (unsigned long)(size_t)v->builtin; }
+      return h ^ (lval_hash(v->formals) * 31 + lval_hash(v->body));
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      for (int i = 0; i != v->count; ++i) { h = h * 31 + lval_hash(v->cell[i]); }
+      return h;
+    case LVAL_FUTURE: return h ^ (unsigned long)(size_t)v->future;
+    case LVAL_CHAN: return h ^ (unsigned long)(size_t)v->chan;
+    case LVAL_SEQ: return h ^ (unsigned long)(size_t)v->seq;
+  }
+  return h;
+}
+
+/* The cache of a memoized function, shared by its copies. Results are
+   kept by argument list in a hash table, and also on a list from most to
+   least recently used, so the least recently used is dropped once there
+   are cap of them. The lock is held only to look up and add, never while
+   the function runs */
+enum { MEMO_SIZE = 1024, MEMO_MAX = 1 << 20 };
+
+typedef struct lmemo_entry {
+  unsigned long hash;
+  lval* args;
+  lval* result;
+  struct lmemo_entry* chain;
+  struct lmemo_entry* newer;
+  struct lmemo_entry* older;
+} lmemo_entry;
+
+struct lmemo {
+  long refs;
+  long lock;
+  long cap;
+  long count;
+  long hits;
+  long misses;
+  unsigned long mask;
+  lmemo_entry** buckets;
+  lmemo_entry* newest;
+  lmemo_entry* oldest;
+};
+
+lmemo* lmemo_new(long cap) {
+  lmemo* m = calloc(1, sizeof(lmemo));
+  m->refs = 1;
+  m->cap = cap;
+  /* At most one entry a bucket on average */
+  unsigned long slots = 1;
+  while (slots < (unsigned long)cap) { slots *= 2; }
+  m->mask = slots - 1;
+  m->buckets = calloc(slots, sizeof(lmemo_entry*));
+  stats.alloc_bytes += sizeof(lmemo) + sizeof(lmemo_entry*) * slots;
+  return m;
+}
+
+void lmemo_retain(lmemo* m) { latomic_add(&m->refs, 1); }
+
+void lmemo_release(lmemo* m) {
+  if (latomic_add(&m->refs, -1) != 0) { return; }
+  lmemo_entry* x = m->newest;
+  while (x) {
+    lmemo_entry* next = x->older;
+    lval_del(x->args);
+    lval_del(x->result);
+    free(x);
+    x = next;
+  }
+  free(m->buckets);
+  free(m);
+}
+
+/* The entry for args, with the lock held */
+static lmemo_entry* lmemo_find(lmemo* m, unsigned long hash, lval* args) {
+  for (lmemo_entry* x = m->buckets[hash & m->mask]; x; x = x->chain) {
+    if (x->hash == hash && lval_eqv(x->args, args)) { return x; }
+  }
+  return NULL;
+}
+
+static void lmemo_unlink(lmemo* m, lmemo_entry* x) {
+  if (x->newer) { x->newer->older = x->older; } else { m->newest = x->older; }
+  if (x->older) { x->older->newer = x->newer; } else { m->oldest = x->newer; }
+}
+
+static void lmemo_push(lmemo* m, lmemo_entry* x) {
+  x->newer = NULL;
+  x->older = m->newest;
+  if (m->newest) { m->newest->newer = x; } else { m->oldest = x; }
+  m->newest = x;
+}
+
+/* Drops the least recently used entry, with the lock held */
+static void lmemo_evict(lmemo* m) {
+  lmemo_entry* x = m->oldest;
+  lmemo_unlink(m, x);
+  lmemo_entry** p = &m->buckets[x->hash & m->mask];
+  while (*p != x) { p = &(*p)->chain; }
+  *p = x->chain;
+  m->count--;
+  lval_del(x->args);
+  lval_del(x->result);
+  free(x);
+}
+
+/* Calls a memoized function, returning a copy of the cached result if
+   there is one. Errors aren't cached, so a call that failed is tried
+   again. Two threads missing on the same arguments both run the function
+   and the first result is kept */
+lval* lmemo_call(linterp* l, lenv* e, lval* f, lval* a) {
+  lmemo* m = f->memo;
+  unsigned long hash = lval_hash(a);
+
+  lspin_lock(&m->lock);
+  lmemo_entry* x = lmemo_find(m, hash, a);
+  if (x) {
+    m->hits++;
+    lmemo_unlink(m, x);
+    lmemo_push(m, x);
+    lval* result = lval_copy(x->result);
+    lspin_unlock(&m->lock);
+    lval_del(a);
+    return result;
+  }
+  m->misses++;
+  lspin_unlock(&m->lock);
+
+  /* Call the function itself. f is the caller's to free, and calling only
+     changes a lambda's formals and environment, so a copy of the struct
+     without the cache does */
+  lval* args = lval_copy(a);
+  lval g = *f;
+  g.memo = NULL;
+  lval* result = lval_call(l, e, &g, a);
+  if (result->type == LVAL_ERR) {
+    lval_del(args);
+    return result;
+  }
+
+  lspin_lock(&m->lock);
+  if (lmemo_find(m, hash, args)) {
+    lval_del(args);
+  } else {
+    x = malloc(sizeof(lmemo_entry));
+    x->hash = hash;
+    x->args = args;
+    x->result = lval_copy(result);
+    x->chain = m->buckets[hash & m->mask];
+    m->buckets[hash & m->mask] = x;
+    lmemo_push(m, x);
+    if (++m->count > m->cap) { lmemo_evict(m); }
+  }
+  lspin_unlock(&m->lock);
+  return result;
+}
+
+/* (memoize f) is f with a cache of the results of its last 1024 distinct
+   argument lists, and (memoize f n) of its last n. Copies share the
+   cache, so a recursive function defined as its memoized self hits it
+   on the way down. Scoping is dynamic, so f should only depend on its
+   arguments */
+lval* builtin_memoize(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2, "'memoize' expects a function and optionally a size.");
+  LASSERT(a, a->cell[0]->type == LVAL_FUN, "'memoize' expects a function.");
+  LASSERT(a, a->count == 1 || a->cell[1]->type == LVAL_NUM, "'memoize' expects a number for its size.");
+  long cap = a->count == 2 ? a->cell[1]->num : MEMO_SIZE;
+  LASSERT(a, cap >= 1 && cap <= MEMO_MAX, "'memoize' size must be from 1 to %i.", MEMO_MAX);
+
+  lval* f = lval_take(a, 0);
+  if (f->memo) { lmemo_release(f->memo); }
+  f->memo = lmemo_new(cap);
+  return f;
+}
+
+/* (memo-stats f) is {{hits n} {misses n} {size n} {capacity n}} */
+lval* builtin_memo_stats(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'memo-stats' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_FUN && a->cell[0]->memo,
+    "'memo-stats' expects a memoized function.");
+
+  lmemo* m = a->cell[0]->memo;
+  lspin_lock(&m->lock);
+  long hits = m->hits, misses = m->misses, count = m->count;
+  lspin_unlock(&m->lock);
+
+  lval* x = lval_qexpr();
+  lval_add(x, stats_pair("hits", hits));
+  lval_add(x, stats_pair("misses", misses));
+  lval_add(x, stats_pair("size", count));
+  lval_add(x, stats_pair("capacity", m->cap));
+  lval_del(a);
+  return x;
+}
+
+lval* lval_join(lval* x, lval* y) {
+  while (y->count != 0) {
+    lval_add(x, lval_pop(y, 0));
+  }
+
+  lval_del(y);
+  return x;
+}
+
+lval* builtin_join(linterp* l, lenv* e, lval* a) {
+  for (int i = 0; i != a->count; ++i) {
+    LASSERT(a, a->cell[i]->type == LVAL_QEXPR, 
+      "Function 'join' passed incorrect type!");
+  }
+
+  lval* x = lval_pop(a, 0);
+
+  while (a->count) {
+    x = lval_join(x, lval_pop(a, 0));
+  }
+
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_cons(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 2, "Function 'cons' should be passed two arguments!");
+  LASSERT(a, a->cell[1]->type == LVAL_QEXPR, "Function 'cons' passed incorrect type!");
+
+  // Create an empty list
+
+  lval* car = lval_pop(a, 0);
+  lval* cdr = lval_pop(a, 0);
+
+  lval_del(a);
+
+  lval* v = lval_qexpr();
+
+  lval_add(v, car);
+
+  while (cdr->count) {
+    lval_add(v, lval_pop(cdr, 0));
+  }
+
+  return v;
+}
+
+lval* builtin_init(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "Function 'init' passed too many arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'init' passed incorrect type!");
+  LASSERT(a, a->cell[0]->count != 0, "Function 'init' passed {}!");
+
+  lval* x = lval_pop(a, 0);
+
+  lval_pop(x, x->count - 1);
+
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_lambda(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 2, "'lambda' expects formals and a body.");
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Formals");
+  LASSERT(a, a->cell[1]->type == LVAL_QEXPR, "lambda expects a body");
+
+  for (int i = 0; i != a->cell[0]->count; ++i) {
+    LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
+      "Cannot define a non-symbol");
+  }
+
+  lval* formals = lval_pop(a, 0);
+  lval* body = lval_pop(a, 0);
+  lval_del(a);
+
+  // TODO: I hate dynamic scoping
+  return lval_lambda(formals, body);
+}
+
+lval* builtin_add(linterp* l, lenv* e, lval* a) {
+  return builtin_op(l, e, a, "+");
+}
+
+lval* builtin_sub(linterp* l, lenv* e, lval* a) {
+  return builtin_op(l, e, a, "-");
+}
+
+lval* builtin_mul(linterp* l, lenv* e, lval* a) {
+  return builtin_op(l, e, a, "*");
+}
+
+lval* builtin_div(linterp* l, lenv* e, lval* a) {
+  return builtin_op(l, e, a, "/");
+}
+
+lval* builtin_mod(linterp* l, lenv* e, lval* a) {
+  return builtin_op(l, e, a, "%");
+}
+
+lval* builtin_pow(linterp* l, lenv* e, lval* a) {
+  return builtin_op(l, e, a, "^");
+}
+
+void lenv_add_builtin(linterp* l, char* name, lbuiltin func) {
+  builtin_register(l, name, func);
+  lval* k = lval_sym(name);
+  lval* v = lval_fun(func);
+  lenv_put(l->env, k, v);
+  lval_del(k); lval_del(v);
+}
+
+lval* builtin_def(linterp* l, lenv* e, lval* a) {
+  return builtin_var(l, e, a, "def");
+}
+
+lval* builtin_put(linterp* l, lenv* e, lval* a) {
+  return builtin_var(l, e, a, "=");
+}
+
+// TODO: Comparing symbols, lists, arbitrary number of things
+lval* builtin_comp(linterp* l, lenv* e, lval* a, char* comp) {
+// Make sure that a is 2 numbers
+  LASSERT(a, a->count == 2, "Comparison expected 2 numbers.");
+
+  for (int i = 0; i != a->count; ++i) {
+    if (a->cell[i]->type != LVAL_NUM) {
+      lval_del(a);
+      return lval_err("Comparison cannot operate on a non-number!");
+    }
+  }
+
+  lval* r = lval_bool(false);
+  lval* x = lval_pop(a, 0);
+  lval* y = lval_pop(a, 0);
+
+
+  if (strcmp(comp, "<") == 0) { r->boolean = x->num < y->num; };
+  if (strcmp(comp, ">") == 0) { r->boolean = x->num > y->num; };
+  if (strcmp(comp, "=") == 0) { r->boolean = x->num == y->num; };
+  if (strcmp(comp, ">=") == 0) { r->boolean = x->num >= y->num; };
+  if (strcmp(comp, "<=") == 0) { r->boolean = x->num <= y->num; };
+  if (strcmp(comp, "!=") == 0) { r->boolean = x->num != y->num; };
+  
+  lval_del(a);
+  lval_del(x);
+  lval_del(y);
+
+  return r;
+}
+
+lval* builtin_lt(linterp* l, lenv* e, lval* a) {
+  return builtin_comp(l, e, a, "<");
+}
+
+lval* builtin_gt(linterp* l, lenv* e, lval* a) {
+  return builtin_comp(l, e, a, ">");
+}
+lval* builtin_eq(linterp* l, lenv* e, lval* a) {
+  return builtin_comp(l, e, a, "=");
+}
+lval* builtin_neq(linterp* l, lenv* e, lval* a) {
+  return builtin_comp(l, e, a, "!=");
+}
+lval* builtin_geq(linterp* l, lenv* e, lval* a) {
+  return builtin_comp(l, e, a, ">=");
+}
+lval* builtin_leq(linterp* l, lenv* e, lval* a) {
+  return builtin_comp(l, e, a, "<=");
+}
+
+lval* builtin_eqv(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 2, "'eqv?' expects 2 arguments");
+  lval* x = lval_bool(lval_eqv(a->cell[0], a->cell[1]));
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_if(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 3, "Arity mismatch, 'if' expects 3 values but got %li", a->count);
+  LASSERT(a, a->cell[0]->type == LVAL_BOOL, "First argument to 'if' should be a bool");
+  LASSERT(a, a->cell[1]->type == LVAL_QEXPR, "'if' expected qexpr");
+  LASSERT(a, a->cell[2]->type == LVAL_QEXPR, "'if' expected qexpr");
+
+  /* Mark Both Expressions as evaluable */
+  lval* x;
+  a->cell[1]->type = LVAL_SEXPR;
+  a->cell[2]->type = LVAL_SEXPR;
+
+  if (a->cell[0]->boolean) {
+    /* If condition is true evaluate first expression */
+    x = lval_eval(l, e, lval_pop(a, 1));
+  } else {
+    /* Otherwise evaluate second expression */
+    x = lval_eval(l, e, lval_pop(a, 2));
+  }
+
+  /* Delete argument list and return */
+  lval_del(a);
+  return x;
+}
+
+/* Parallel map and reduce. The list is cut into chunks, a few for each
+   thread so threads that finish early take more, and each chunk runs in
+   a context of its own: a linterp borrowing the caller's parsers and
+   builtins, whose top level environment is a snapshot of the caller's.
+   Snapshots share the caller's top level bindings rather than copying
+   them, and the threads read them without locks. Lists too short to be
+   worth splitting are done on this thread */
+enum { PMAP_MIN_CHUNK = 32, PMAP_CHUNKS_PER_THREAD = 4, PMAP_MAX_WORKERS = 1024 };
+
+int linterp_workers(linterp* l) {
+  linterp* r = linterp_root(l);
+  return r->workers < 0 ? threadpool_cpus() - 1 : r->workers;
+}
+
+/* The pool can't be replaced while futures still hold tasks from it, or
+   processes might start more */
+int linterp_set_workers(linterp* l, int workers) {
+  if (l->procs && threadpool_pending(l->procs)) { return 0; }
+  if (l->pool && threadpool_pending(l->pool)) { return 0; }
+  if (l->pool) { threadpool_del(l->pool); }
+  l->pool = NULL;
+  l->workers = workers;
+  return 1;
+}
+
+threadpool* linterp_pool(linterp* l) {
+  linterp* r = linterp_root(l);
+  lspin_lock(&r->lock);
+  if (!r->pool) { r->pool = threadpool_new(linterp_workers(r), mpc_thread_cleanup); }
+  lspin_unlock(&r->lock);
+  return r->pool;
+}
+
+/* Makes w a context for running part of a pmap, a future or a process
+   over a snapshot of e */
+void linterp_fork(linterp* l, lenv* e, linterp* w) {
+  memset(w, 0, sizeof(linterp));
+  w->Number = l->Number;
+  w->String = l->String;
+  w->Boolean = l->Boolean;
+  w->Comment = l->Comment;
+  w->Symbol = l->Symbol;
+  w->Sexpr = l->Sexpr;
+  w->Qexpr = l->Qexpr;
+  w->Expr = l->Expr;
+  w->Lispy = l->Lispy;
+  w->builtins = l->builtins;
+  w->root = linterp_root(l);
+  w->env = lenv_snapshot(e);
+}
+
+/* Frees a context made by linterp_fork. The names of functions it
+   defined are the root's, so they outlive it */
+void linterp_join(linterp* w) {
+  lenv_del(w->env);
+  load_cache_free(w);
+}
+
+/* Calls f with the arguments in a, taking a but not f. Calling a lambda
+   binds its formals as it goes, so only lambdas are copied */
+lval* lval_apply(linterp* l, lenv* e, lval* f, lval* a) {
+  lval* g = f->builtin ? f : lval_copy(f);
+  prof_frame replaced = prof_push(l, g);
+  lval* x = lval_call(l, e, g, a);
+  prof_pop(l, replaced);
+  if (g != f) { lval_del(g); }
+  return x;
+}
+
+/* The argument list (x y), taking both */
+lval* lval_args2(lval* x, lval* y) {
+  lval* a = lval_sexpr();
+  a->cell = malloc(sizeof(lval*) * 2);
+  a->cell[0] = x;
+  a->cell[1] = y;
+  a->count = 2;
+  return a;
+}
+
+/* Replaces each item of list with f applied to it, or returns the first error */
+lval* lval_map(linterp* l, lenv* e, lval* f, lval* list) {
+  for (int i = 0; i != list->count; ++i) {
+    list->cell[i] = lval_apply(l, e, f, lval_add(lval_sexpr(), list->cell[i]));
+    if (list->cell[i]->type == LVAL_ERR) { return lval_take(list, i); }
+  }
+  return list;
+}
+
+/* (f (f acc item0) item1)... taking acc and list, or the first error */
+lval* lval_fold(linterp* l, lenv* e, lval* f, lval* acc, lval* list) {
+  for (int i = 0; i != list->count; ++i) {
+    if (acc->type == LVAL_ERR) { lval_del(list->cell[i]); continue; }
+    acc = lval_apply(l, e, f, lval_args2(acc, list->cell[i]));
+  }
+  /* Every item has been passed to f or deleted */
+  list->count = 0;
+  lval_del(list);
+  return acc;
+}
+
+/* A lazy sequence is a recipe rather than its items: a source, and the
+   map, filter, take and drop steps stacked on it. Recipes never change,
+   so copies share one. Each consumer builds its own chain of lseq_iter
+   and pulls one item at a time through it, so a pipeline holds one item
+   per step however long the source is */
+typedef enum { LSEQ_LIST, LSEQ_RANGE, LSEQ_LINES,
+               LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE, LSEQ_DROP } lseq_kind;
+
+struct lseq {
+  long refs;
+  lseq_kind kind;
+  /* The items of a list, the name of a file of lines, or the function of
+     a map or filter */
+  lval* val;
+  /* A range runs from first towards end by step, take and drop use n */
+  long first;
+  long end;
+  long step;
+  long n;
+  lseq* src;
+};
+
+lseq* lseq_new(lseq_kind kind, lval* val, lseq* src) {
+  lseq* s = calloc(1, sizeof(lseq));
+  s->refs = 1;
+  s->kind = kind;
+  s->val = val;
+  s->src = src;
+  stats.alloc_bytes += sizeof(lseq);
+  return s;
+}
+
+void lseq_retain(lseq* s) { latomic_add(&s->refs, 1); }
+
+void lseq_release(lseq* s) {
+  while (s && latomic_add(&s->refs, -1) == 0) {
+    lseq* src = s->src;
+    if (s->val) { lval_del(s->val); }
+    free(s);
+    s = src;
+  }
+}
+
+lval* lval_seq(lseq* s) {
+  lval* v = lval_alloc(LVAL_SEQ);
+  v->seq = s;
+  return v;
+}
+
+/* One consumer's place in a sequence, with one per step of the recipe */
+typedef struct lseq_iter {
+  lseq* seq;
+  long pos;
+  FILE* file;
+  char* line;
+  size_t cap;
+  struct lseq_iter* src;
+} lseq_iter;
+
+lseq_iter* lseq_iter_new(lseq* s) {
+  lseq_iter* it = calloc(1, sizeof(lseq_iter));
+  it->seq = s;
+  it->pos = s->kind == LSEQ_RANGE ? s->first : 0;
+  if (s->src) { it->src = lseq_iter_new(s->src); }
+  return it;
+}
+
+void lseq_iter_del(lseq_iter* it) {
+  while (it) {
+    lseq_iter* src = it->src;
+    if (it->file) { fclose(it->file); }
+    free(it->line);
+    free(it);
+    it = src;
+  }
+}
+
+/* Reads the next line into it->line without its line ending, or returns
+   0 at the end of the file */
+static int lseq_read_line(lseq_iter* it) {
+  size_t n = 0;
+  int c;
+  while ((c = getc(it->file)) != EOF && c != '\n') {
+    if (n + 1 >= it->cap) {
+      it->cap = it->cap ? it->cap * 2 : 128;
+      it->line = realloc(it->line, it->cap);
+    }
+    it->line[n++] = (char)c;
+  }
+  if (c == EOF && n == 0) { return 0; }
+  if (!it->line) {
+    it->cap = 128;
+    it->line = malloc(it->cap);
+  }
+  if (n && it->line[n - 1] == '\r') { n--; }
+  it->line[n] = '\0';
+  return 1;
+}
+
+/* The next item, NULL at the end, or an error from the source or a step's
+   function. Functions are called in e, as they would be by the consumer */
+lval* lseq_next(linterp* l, lenv* e, lseq_iter* it) {
+  lseq* s = it->seq;
+  switch (s->kind) {
+    case LSEQ_LIST:
+      if (it->pos == s->val->count) { return NULL; }
+      return lval_copy(s->val->cell[it->pos++]);
+
+    case LSEQ_RANGE: {
+      if (s->step > 0 ? it->pos >= s->end : it->pos <= s->end) { return NULL; }
+      long x = it->pos;
+      /* Stop rather than overflow past the end */
+      if ((s->step > 0 && x > LONG_MAX - s->step) ||
+          (s->step < 0 && x < LONG_MIN - s->step)) {
+        it->pos = s->end;
+      } else {
+        it->pos += s->step;
+      }
+      return lval_num(x);
+    }
+
+    case LSEQ_LINES:
+      if (!it->file) {
+        if (it->pos) { return NULL; }
+        it->file = fopen(s->val->string, "r");
+        if (!it->file) { return lval_err("Unable to open file '%s'!", s->val->string); }
+        it->pos = 1;
+      }
+      if (!lseq_read_line(it)) {
+        fclose(it->file);
+        it->file = NULL;
+        return NULL;
+      }
+      return lval_str(it->line);
+
+    case LSEQ_MAP: {
+      lval* x = lseq_next(l, e, it->src);
+      if (!x || x->type == LVAL_ERR) { return x; }
+      return lval_apply(l, e, s->val, lval_add(lval_sexpr(), x));
+    }
+
+    case LSEQ_FILTER:
+      while (1) {
+        lval* x = lseq_next(l, e, it->src);
+        if (!x || x->type == LVAL_ERR) { return x; }
+        lval* keep = lval_apply(l, e, s->val, lval_add(lval_sexpr(), lval_copy(x)));
+        if (keep->type != LVAL_BOOL) {
+          lval_del(x);
+          if (keep->type == LVAL_ERR) { return keep; }
+          lval_del(keep);
+          return lval_err("'filter' expects its function to return a bool.");
+        }
+        bool kept = keep->boolean;
+        lval_del(keep);
+        if (kept) { return x; }
+        lval_del(x);
+      }
+
+    case LSEQ_TAKE:
+      /* Stop pulling as soon as there are enough, so a file is read no
+         further than it needs to be */
+      if (it->pos == s->n) { return NULL; }
+      it->pos++;
+      return lseq_next(l, e, it->src);
+
+    case LSEQ_DROP:
+      while (it->pos != s->n) {
+        lval* x = lseq_next(l, e, it->src);
+        if (!x || x->type == LVAL_ERR) { return x; }
+        lval_del(x);
+        it->pos++;
+      }
+      return lseq_next(l, e, it->src);
+  }
+  return NULL;
+}
+
+/* (seq {list}) is a sequence of the list's items */
+lval* builtin_seq(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'seq' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_SEQ,
+    "'seq' expects a list.");
+  if (a->cell[0]->type == LVAL_SEQ) { return lval_take(a, 0); }
+  return lval_seq(lseq_new(LSEQ_LIST, lval_take(a, 0), NULL));
+}
+
+/* (seq-range n), (seq-range m n) and (seq-range m n step) count as range
+   does, without the limit on how many */
+lval* builtin_seq_range(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1 && a->count <= 3, "'seq-range' expects 1 to 3 numbers.");
+  for (int i = 0; i != a->count; ++i) {
+    LASSERT(a, a->cell[i]->type == LVAL_NUM, "'seq-range' expects numbers.");
+  }
+  LASSERT(a, a->count != 3 || a->cell[2]->num != 0, "'seq-range' step can't be 0.");
+
+  lseq* s = lseq_new(LSEQ_RANGE, NULL, NULL);
+  s->first = a->count >= 2 ? a->cell[0]->num : 0;
+  s->end = a->cell[a->count >= 2 ? 1 : 0]->num;
+  s->step = a->count == 3 ? a->cell[2]->num : 1;
+  lval_del(a);
+  return lval_seq(s);
+}
+
+/* (lines-of-file "name") is a sequence of the file's lines, without their
+   line endings. The file is opened by whatever consumes it */
+lval* builtin_lines_of_file(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'lines-of-file' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_STR, "'lines-of-file' expects a string.");
+  return lval_seq(lseq_new(LSEQ_LINES, lval_take(a, 0), NULL));
+}
+
+/* (take n xs) and (drop n xs), the first n items of a list or sequence
+   and the rest. They're lazy on a sequence */
+lval* lval_take_drop(lval* a, char* name, bool take) {
+  LASSERT(a, a->count == 2, "'%s' expects a number and a list.", name);
+  LASSERT(a, a->cell[0]->type == LVAL_NUM, "'%s' expects a number.", name);
+  LASSERT(a, a->cell[1]->type == LVAL_QEXPR || a->cell[1]->type == LVAL_SEQ,
+    "'%s' expects a list or a sequence.", name);
+  LASSERT(a, a->cell[0]->num >= 0, "'%s' expects a count of at least 0.", name);
+
+  long n = a->cell[0]->num;
+  lval* xs = a->cell[1];
+  if (xs->type == LVAL_SEQ) {
+    lseq* s = lseq_new(take ? LSEQ_TAKE : LSEQ_DROP, NULL, xs->seq);
+    lseq_retain(xs->seq);
+    s->n = n;
+    lval_del(a);
+    return lval_seq(s);
+  }
+
+  int k = n < xs->count ? (int)n : xs->count;
+  lval* x = lval_take(a, 1);
+  if (take) {
+    while (x->count > k) { lval_del(lval_pop(x, x->count - 1)); }
+  } else {
+    for (int i = 0; i != k; ++i) { lval_del(x->cell[i]); }
+    memmove(x->cell, x->cell + k, sizeof(lval*) * (x->count - k));
+    x->count -= k;
+  }
+  return x;
+}
+
+lval* builtin_take(linterp* l, lenv* e, lval* a) {
+  return lval_take_drop(a, "take", true);
+}
+
+lval* builtin_drop(linterp* l, lenv* e, lval* a) {
+  return lval_take_drop(a, "drop", false);
+}
+
+/* (for-each f xs) calls f on each item of a list or sequence in turn,
+   returning () or the first error */
+lval* builtin_for_each(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 2, "'for-each' expects a function and a list.");
+  LASSERT(a, a->cell[0]->type == LVAL_FUN, "'for-each' expects a function.");
+  LASSERT(a, a->cell[1]->type == LVAL_QEXPR || a->cell[1]->type == LVAL_SEQ,
+    "'for-each' expects a list or a sequence.");
+
+  lval* f = a->cell[0];
+  lval* xs = a->cell[1];
+  lval* err = NULL;
+  if (xs->type == LVAL_QEXPR) {
+    for (int i = 0; i != xs->count && !err; ++i) {
+      lval* r = lval_apply(l, e, f, lval_add(lval_sexpr(), lval_copy(xs->cell[i])));
+      if (r->type == LVAL_ERR) { err = r; } else { lval_del(r); }
+    }
+  } else {
+    lseq_iter* it = lseq_iter_new(xs->seq);
+    lval* x;
+    while (!err && (x = lseq_next(l, e, it))) {
+      if (x->type == LVAL_ERR) { err = x; break; }
+      lval* r = lval_apply(l, e, f, lval_add(lval_sexpr(), x));
+      if (r->type == LVAL_ERR) { err = r; } else { lval_del(r); }
+    }
+    lseq_iter_del(it);
+  }
+  lval_del(a);
+  return err ? err : lval_sexpr();
+}
+
+/* (collect xs) is the items of a sequence as a list */
+lval* builtin_collect(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'collect' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_SEQ || a->cell[0]->type == LVAL_QEXPR,
+    "'collect' expects a sequence.");
+  if (a->cell[0]->type == LVAL_QEXPR) { return lval_take(a, 0); }
+
+  lseq_iter* it = lseq_iter_new(a->cell[0]->seq);
+  lval* list = lval_qexpr();
+  int cap = 0;
+  lval* x;
+  while ((x = lseq_next(l, e, it))) {
+    if (x->type == LVAL_ERR) {
+      lval_del(list);
+      list = x;
+      break;
+    }
+    if (list->count == cap) {
+      cap = cap ? cap * 2 : 16;
+      list->cell = realloc(list->cell, sizeof(lval*) * cap);
+    }
+    list->cell[list->count++] = x;
+  }
+  lseq_iter_del(it);
+  lval_del(a);
+  return list;
+}
+
+/* List functions written in C, rather than in Lisp on head and tail,
+   which copy the rest of the list at every step. They walk the list's
+   cells once and call f directly */
+enum { RANGE_MAX = 1 << 24 };
+
+/* A map or filter step on the sequence in a, taking a */
+lval* lval_seq_step(lval* a, lseq_kind kind) {
+  lval* f = lval_pop(a, 0);
+  lseq* s = lseq_new(kind, f, a->cell[0]->seq);
+  lseq_retain(s->src);
+  lval_del(a);
+  return lval_seq(s);
+}
+
+/* (map f {list}) is {(f item) ...}, and lazily the same on a sequence */
+lval* builtin_map(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 2, "'map' expects a function and a list.");
+  LASSERT(a, a->cell[0]->type == LVAL_FUN, "'map' expects a function.");
+  LASSERT(a, a->cell[1]->type == LVAL_QEXPR || a->cell[1]->type == LVAL_SEQ,
+    "'map' expects a list or a sequence.");
+  if (a->cell[1]->type == LVAL_SEQ) { return lval_seq_step(a, LSEQ_MAP); }
+
+  lval* f = lval_pop(a, 0);
+  lval* x = lval_map(l, e, f, lval_take(a, 0));
+  lval_del(f);
+  return x;
+}
+
+/* (filter f {list}) is the items for which (f item) is true, lazily on
+   a sequence */
+lval* builtin_filter(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 2, "'filter' expects a function and a list.");
+  LASSERT(a, a->cell[0]->type == LVAL_FUN, "'filter' expects a function.");
+  LASSERT(a, a->cell[1]->type == LVAL_QEXPR || a->cell[1]->type == LVAL_SEQ,
+    "'filter' expects a list or a sequence.");
+  if (a->cell[1]->type == LVAL_SEQ) { return lval_seq_step(a, LSEQ_FILTER); }
+
+  lval* f = a->cell[0];
+  lval* list = a->cell[1];
+  lval* x = lval_qexpr();
+  x->cell = malloc(sizeof(lval*) * list->count);
+  lval* err = NULL;
+
+  for (int i = 0; i != list->count && !err; ++i) {
+    lval* keep = lval_apply(l, e, f, lval_add(lval_sexpr(), lval_copy(list->cell[i])));
+    if (keep->type == LVAL_BOOL) {
+      /* Kept items move across rather than being copied */
+      if (keep->boolean) {
+        x->cell[x->count++] = list->cell[i];
+        list->cell[i] = NULL;
+      }
+      lval_del(keep);
+    } else if (keep->type == LVAL_ERR) {
+      err = keep;
+    } else {
+      lval_del(keep);
+      err = lval_err("'filter' expects its function to return a bool.");
+    }
+  }
+
+  /* Close the gaps the kept items left, so the list frees cleanly */
+  int n = 0;
+  for (int i = 0; i != list->count; ++i) {
+    if (list->cell[i]) { list->cell[n++] = list->cell[i]; }
+  }
+  list->count = n;
+  lval_del(a);
+
+  if (err) {
+    lval_del(x);
+    return err;
+  }
+  x->cell = realloc(x->cell, sizeof(lval*) * x->count);
+  return x;
+}
+
+/* (foldl f init {list}) is (f ... (f (f init item0) item1) ...). On a
+   sequence it pulls one item at a time */
+lval* builtin_foldl(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 3, "'foldl' expects a function, a start value and a list.");
+  LASSERT(a, a->cell[0]->type == LVAL_FUN, "'foldl' expects a function.");
+  LASSERT(a, a->cell[2]->type == LVAL_QEXPR || a->cell[2]->type == LVAL_SEQ,
+    "'foldl' expects a list or a sequence.");
+
+  lval* f = lval_pop(a, 0);
+  lval* init = lval_pop(a, 0);
+  if (a->cell[0]->type == LVAL_SEQ) {
+    lseq_iter* it = lseq_iter_new(a->cell[0]->seq);
+    lval* x;
+    while (init->type != LVAL_ERR && (x = lseq_next(l, e, it))) {
+      if (x->type == LVAL_ERR) {
+        lval_del(init);
+        init = x;
+      } else {
+        init = lval_apply(l, e, f, lval_args2(init, x));
+      }
+    }
+    lseq_iter_del(it);
+    lval_del(f);
+    lval_del(a);
+    return init;
+  }
+  lval* x = lval_fold(l, e, f, init, lval_take(a, 0));
+  lval_del(f);
+  return x;
+}
+
+/* (range n) is {0 1 ... n-1}, and (range m n) is {m ... n-1} */
+lval* builtin_range(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2, "'range' expects 1 or 2 numbers.");
+  for (int i = 0; i != a->count; ++i) {
+    LASSERT(a, a->cell[i]->type == LVAL_NUM, "'range' expects numbers.");
+  }
+
+  long first = a->count == 2 ? a->cell[0]->num : 0;
+  long end = a->cell[a->count - 1]->num;
+  /* The width of far apart bounds doesn't fit in a long */
+  unsigned long width = end > first ? (unsigned long)end - (unsigned long)first : 0;
+  LASSERT(a, width <= RANGE_MAX, "'range' can make at most %i items, not %lu.", RANGE_MAX, width);
+  long n = (long)width;
+  lval_del(a);
+
+  lval* x = lval_qexpr();
+  x->cell = malloc(sizeof(lval*) * n);
+  x->count = (int)n;
+  for (long i = 0; i != n; ++i) { x->cell[i] = lval_num(first + i); }
+  return x;
+}
+
+/* (len {list}) is the number of items, and (len "string") of characters */
+lval* builtin_len(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'len' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_STR,
+    "'len' expects a list or a string.");
+
+  long n = a->cell[0]->type == LVAL_STR
+    ? (long)strlen(a->cell[0]->string)
+    : a->cell[0]->count;
+  lval_del(a);
+  return lval_num(n);
+}
+
+/* Sorting, for sort. Numbers are radix sorted on their bits. Anything else
+   is merge sorted, which compares by strcmp for strings and by calling the
+   function given otherwise. Both are stable, so equal items keep their
+   order */
+enum { SORT_RUN = 32 };
+
+typedef struct {
+  linterp* l;
+  lenv* e;
+  /* The comparison function, or NULL to compare strings */
+  lval* f;
+  /* The first error from f, after which every pair counts as in order */
+  lval* err;
+} lsort;
+
+/* Whether y goes before x */
+static bool lsort_less(lsort* s, lval* y, lval* x) {
+  if (!s->f) { return strcmp(y->string, x->string) < 0; }
+  if (s->err) { return false; }
+  lval* r = lval_apply(s->l, s->e, s->f, lval_args2(lval_copy(y), lval_copy(x)));
+  if (r->type == LVAL_BOOL) {
+    bool less = r->boolean;
+    lval_del(r);
+    return less;
+  }
+  if (r->type == LVAL_ERR) {
+    s->err = r;
+  } else {
+    lval_del(r);
+    s->err = lval_err("'sort' expects its function to return a bool.");
+  }
+  return false;
+}
+
+/* Sorts runs of SORT_RUN by insertion, then merges pairs of runs back and
+   forth between cells and a buffer. Two runs already in order are copied
+   without merging, so sorted input takes one comparison per run */
+void lsort_merge(lsort* s, lval** cells, int n) {
+  for (int first = 0; first < n; first += SORT_RUN) {
+    int end = first + SORT_RUN < n ? first + SORT_RUN : n;
+    for (int i = first + 1; i < end; ++i) {
+      lval* x = cells[i];
+      int j = i;
+      while (j > first && lsort_less(s, x, cells[j - 1])) {
+        cells[j] = cells[j - 1];
+        j--;
+      }
+      cells[j] = x;
+    }
+  }
+
+  lval** from = cells;
+  lval** to = malloc(sizeof(lval*) * n);
+  for (int width = SORT_RUN; width < n; width *= 2) {
+    for (int first = 0; first < n; first += 2 * width) {
+      int mid = first + width < n ? first + width : n;
+      int end = first + 2 * width < n ? first + 2 * width : n;
+      if (mid == end || !lsort_less(s, from[mid], from[mid - 1])) {
+        memcpy(to + first, from + first, sizeof(lval*) * (end - first));
+        continue;
+      }
+      int i = first, j = mid, k = first;
+      while (i < mid && j < end) {
+        to[k++] = lsort_less(s, from[j], from[i]) ? from[j++] : from[i++];
+      }
+      while (i < mid) { to[k++] = from[i++]; }
+      while (j < end) { to[k++] = from[j++]; }
+    }
+    lval** swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != cells) {
+    memcpy(cells, from, sizeof(lval*) * n);
+    to = from;
+  }
+  free(to);
+}
+
+typedef struct {
+  unsigned long key;
+  lval* v;
+} lsort_key;
+
+/* A least significant byte first radix sort. Flipping the sign bit makes
+   the keys of negative numbers sort below the rest, and bytes that are
+   the same for every key are skipped */
+void lsort_radix(lval** cells, int n) {
+  lsort_key* keys = malloc(sizeof(lsort_key) * n);
+  lsort_key* tmp = malloc(sizeof(lsort_key) * n);
+  unsigned long sign = 1UL << (sizeof(long) * 8 - 1);
+  for (int i = 0; i != n; ++i) {
+    keys[i].key = (unsigned long)cells[i]->num ^ sign;
+    keys[i].v = cells[i];
+  }
+
+  for (unsigned shift = 0; shift < sizeof(long) * 8; shift += 8) {
+    int count[256] = { 0 };
+    for (int i = 0; i != n; ++i) { count[(keys[i].key >> shift) & 0xff]++; }
+    if (count[(keys[0].key >> shift) & 0xff] == n) { continue; }
+
+    int pos = 0;
+    for (int b = 0; b != 256; ++b) {
+      int c = count[b];
+      count[b] = pos;
+      pos += c;
+    }
+    for (int i = 0; i != n; ++i) { tmp[count[(keys[i].key >> shift) & 0xff]++] = keys[i]; }
+    lsort_key* swap = keys;
+    keys = tmp;
+    tmp = swap;
+  }
+
+  for (int i = 0; i != n; ++i) { cells[i] = keys[i].v; }
+  free(keys);
+  free(tmp);
+}
+
+/* (sort {list}) sorts numbers or strings into ascending order, and
+   (sort f {list}) by f, where (f x y) is true when x goes before y */
+lval* builtin_sort(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2, "'sort' expects a list, and optionally a function first.");
+  LASSERT(a, a->count == 1 || a->cell[0]->type == LVAL_FUN, "'sort' expects a function.");
+  LASSERT(a, a->cell[a->count - 1]->type == LVAL_QEXPR, "'sort' expects a list.");
+
+  lsort s = { l, e, NULL, NULL };
+  if (a->count == 2) { s.f = lval_pop(a, 0); }
+  lval* list = lval_take(a, 0);
+  if (list->count < 2) {
+    if (s.f) { lval_del(s.f); }
+    return list;
+  }
+
+  if (!s.f) {
+    Val_Type type = list->cell[0]->type;
+    for (int i = 0; i != list->count; ++i) {
+      if (list->cell[i]->type != type || (type != LVAL_NUM && type != LVAL_STR)) {
+        lval_del(list);
+        return lval_err("'sort' expects all numbers or all strings, or a function to compare with.");
+      }
+    }
+    if (type == LVAL_NUM) {
+      lsort_radix(list->cell, list->count);
+      return list;
+    }
+  }
+
+  lsort_merge(&s, list->cell, list->count);
+  if (s.f) { lval_del(s.f); }
+  if (s.err) {
+    lval_del(list);
+    return s.err;
+  }
+  return list;
+}
+
+/* Moves count items of list, from first, into a new Q-Expression */
+lval* lval_chunk(lval* list, int first, int count) {
+  lval* x = lval_qexpr();
+  x->count = count;
+  x->cell = malloc(sizeof(lval*) * count);
+  memcpy(x->cell, list->cell + first, sizeof(lval*) * count);
+  return x;
+}
+
+/* Joins a Q-Expression of Q-Expressions into one, taking it */
+lval* lval_concat(lval* lists) {
+  int total = 0;
+  for (int i = 0; i != lists->count; ++i) { total += lists->cell[i]->count; }
+
+  lval* x = lval_qexpr();
+  x->cell = malloc(sizeof(lval*) * total);
+  for (int i = 0; i != lists->count; ++i) {
+    lval* y = lists->cell[i];
+    memcpy(x->cell + x->count, y->cell, sizeof(lval*) * y->count);
+    x->count += y->count;
+    y->count = 0;
+  }
+  lval_del(lists);
+  return x;
+}
+
+typedef struct {
+  linterp ctx;
+  lval* f;
+  /* For preduce, the chunk's first item, which the rest are folded into */
+  lval* acc;
+  lval* items;
+  lval* result;
+  lstats stats;
+} pmap_job;
+
+/* Counts the chunk separately, as load_job_run does */
+static void pmap_job_run(void* arg) {
+  pmap_job* job = arg;
+  lstats saved = stats;
+  memset(&stats, 0, sizeof(stats));
+  job->result = job->acc
+    ? lval_fold(&job->ctx, job->ctx.env, job->f, job->acc, job->items)
+    : lval_map(&job->ctx, job->ctx.env, job->f, job->items);
+  job->stats = stats;
+  stats = saved;
+}
+
+/* Maps f over list, or with init folds it into init, in chunks of 'size'
+   items, or a size of its choosing if that's 0. Takes init and list */
+lval* pmap_run(linterp* l, lenv* e, lval* f, lval* init, lval* list, long size) {
+  int n = list->count;
+  int threads = linterp_workers(l) + 1;
+  if (size <= 0) {
+    size = n / (threads * PMAP_CHUNKS_PER_THREAD) + 1;
+    if (size < PMAP_MIN_CHUNK) { size = PMAP_MIN_CHUNK; }
+  }
+
+  if (threads == 1 || n <= size) {
+    return init ? lval_fold(l, e, f, init, list) : lval_map(l, e, f, list);
+  }
+
+  threadpool* pool = linterp_pool(l);
+  int count = (int)((n + size - 1) / size);
+  pmap_job* jobs = malloc(sizeof(pmap_job) * count);
+  tp_task** tasks = malloc(sizeof(tp_task*) * count);
+
+  for (int i = 0; i != count; ++i) {
+    int first = (int)(i * size);
+    int len = n - first < size ? n - first : (int)size;
+    linterp_fork(l, e, &jobs[i].ctx);
+    jobs[i].f = f;
+    jobs[i].acc = init ? list->cell[first] : NULL;
+    jobs[i].items = init
+      ? lval_chunk(list, first + 1, len - 1)
+      : lval_chunk(list, first, len);
+    tasks[i] = threadpool_submit(pool, pmap_job_run, &jobs[i]);
+  }
+  /* The items belong to the chunks now */
+  list->count = 0;
+  lval_del(list);
+
+  lval* results = lval_qexpr();
+  for (int i = 0; i != count; ++i) {
+    threadpool_wait(pool, tasks[i]);
+    lstats_add(&stats, &jobs[i].stats);
+    linterp_join(&jobs[i].ctx);
+    lval_add(results, jobs[i].result);
+  }
+  free(tasks);
+  free(jobs);
+
+  /* The first error in list order, as the sequential path would give */
+  for (int i = 0; i != results->count; ++i) {
+    if (results->cell[i]->type == LVAL_ERR) {
+      if (init) { lval_del(init); }
+      return lval_take(results, i);
+    }
+  }
+
+  return init ? lval_fold(l, e, f, init, results) : lval_concat(results);
+}
+
+/* (pmap f {list}) is {(f item) ...}, evaluated on the worker threads, and
+   (pmap f {list} n) takes n items at a time. f should only read its
+   arguments and globals: each chunk has a top level of its own, so
+   anything it defines is gone when the chunk ends */
+lval* builtin_pmap(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "'pmap' expects a function, a list and an optional chunk size.");
+  LASSERT(a, a->cell[0]->type == LVAL_FUN, "'pmap' expects a function.");
+  LASSERT(a, a->cell[1]->type == LVAL_QEXPR, "'pmap' expects a list.");
+  LASSERT(a, a->count == 2 || (a->cell[2]->type == LVAL_NUM && a->cell[2]->num > 0),
+    "'pmap' chunk size must be a positive number.");
+
+  long size = a->count == 3 ? a->cell[2]->num : 0;
+  lval* f = lval_pop(a, 0);
+  lval* list = lval_pop(a, 0);
+  lval_del(a);
+
+  lval* x = pmap_run(l, e, f, NULL, list, size);
+  lval_del(f);
+  return x;
+}
+
+/* (preduce f init {list}) is (f ... (f (f init item0) item1) ...), and
+   (preduce f init {list} n) takes n items at a time. Chunks are folded
+   on the worker threads and their results folded into init in order, so
+   f must be associative */
+lval* builtin_preduce(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 3 || a->count == 4,
+    "'preduce' expects a function, a start value, a list and an optional chunk size.");
+  LASSERT(a, a->cell[0]->type == LVAL_FUN, "'preduce' expects a function.");
+  LASSERT(a, a->cell[2]->type == LVAL_QEXPR, "'preduce' expects a list.");
+  LASSERT(a, a->count == 3 || (a->cell[3]->type == LVAL_NUM && a->cell[3]->num > 0),
+    "'preduce' chunk size must be a positive number.");
+
+  long size = a->count == 4 ? a->cell[3]->num : 0;
+  lval* f = lval_pop(a, 0);
+  lval* init = lval_pop(a, 0);
+  lval* list = lval_pop(a, 0);
+  lval_del(a);
+
+  lval* x = pmap_run(l, e, f, init, list, size);
+  lval_del(f);
+  return x;
+}
+
+/* (workers ()) is the number of threads pmap and spawn use besides the
+   caller's, (workers n) sets it */
+lval* builtin_workers(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'workers' expects 1 argument.");
+  if (a->cell[0]->type == LVAL_NUM) {
+    long n = a->cell[0]->num;
+    LASSERT(a, n >= 0 && n <= PMAP_MAX_WORKERS,
+      "'workers' must be between 0 and %i, got %li.", PMAP_MAX_WORKERS, n);
+    LASSERT(a, !l->root, "'workers' can't be changed inside pmap, spawn or process.");
+    LASSERT(a, linterp_set_workers(l, (int)n),
+      "'workers' can't be changed while futures are pending or processes running.");
+  }
+  lval_del(a);
+  return lval_num(linterp_workers(l));
+}
+
+/* Futures. (spawn {expr}) starts expr on the pool and returns a future,
+   which (await f) turns into expr's value, waiting for it if need be.
+   Values only cross threads as copies: the task runs in a context of its
+   own, as a pmap chunk does, over a snapshot of the environment spawn was
+   called in, and await copies the result out. Copies of a future share
+   one lfuture, which the last of them to go frees */
+struct lfuture {
+  threadpool* pool;
+  tp_task* task;
+  linterp ctx;
+  lval* expr;
+  lval* result;
+  lstats stats;
+  /* Copies may be made, deleted and awaited on any thread */
+  long refs;
+  long finished;
+};
+
+static void lfuture_run(void* arg) {
+  lfuture* f = arg;
+  lstats saved = stats;
+  memset(&stats, 0, sizeof(stats));
+  f->result = lval_eval(&f->ctx, f->ctx.env, f->expr);
+  f->expr = NULL;
+  f->stats = stats;
+  stats = saved;
+  latomic_add(&f->ctx.root->running, -1);
+  threadpool_event_notify();
+}
+
+/* Once the task has run, the first thread here counts its work as its
+   own and frees what only the task used */
+static void lfuture_finish(lfuture* f) {
+  if (latomic_add(&f->finished, 1) != 1) { return; }
+  lstats_add(&stats, &f->stats);
+  lenv_del(f->ctx.env);
+  load_cache_free(&f->ctx);
+}
+
+void lfuture_retain(lfuture* f) { latomic_add(&f->refs, 1); }
+
+/* Dropping the last copy of a future waits for its task, which uses it */
+void lfuture_release(lfuture* f) {
+  if (latomic_add(&f->refs, -1) != 0) { return; }
+  threadpool_join(f->pool, f->task);
+  threadpool_task_free(f->pool, f->task);
+  lfuture_finish(f);
+  lval_del(f->result);
+  free(f);
+}
+
+lval* lfuture_await(lfuture* f) {
+  threadpool_join(f->pool, f->task);
+  lfuture_finish(f);
+  return lval_copy(f->result);
+}
+
+/* (spawn {expr}) evaluates expr on the worker threads, returning a future
+   for its value at once. expr sees the environment as it was when spawned,
+   and anything it defines stays its own */
+lval* builtin_spawn(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'spawn' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "'spawn' expects a Q-Expression.");
+
+  lfuture* f = calloc(1, sizeof(lfuture));
+  stats.alloc_bytes += sizeof(lfuture);
+  f->refs = 1;
+  f->pool = linterp_pool(l);
+  linterp_fork(l, e, &f->ctx);
+  f->expr = lval_take(a, 0);
+  f->expr->type = LVAL_SEXPR;
+
+  latomic_add(&f->ctx.root->running, 1);
+  f->task = threadpool_submit(f->pool, lfuture_run, f);
+
+  lval* v = lval_alloc(LVAL_FUTURE);
+  v->future = f;
+  return v;
+}
+
+/* (await f) is the value of the future f, waiting until it's ready */
+lval* builtin_await(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'await' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_FUTURE, "'await' expects a future.");
+
+  lval* x = lfuture_await(a->cell[0]->future);
+  lval_del(a);
+  return x;
+}
+
+/* Channels. (chan n) holds up to n values, which (send c v) and (recv c)
+   pass between processes, each waiting while the channel is full or
+   empty. A channel is a ring of slots, each with a sequence number saying
+   whether it's ready to be written or read on this lap round the ring, so
+   senders and receivers claim slots with a compare and swap and never
+   lock. Threads with nothing to do wait on the pool's event count, which
+   every send, recv and close moves on. Copies of a channel share one
+   lchan, which the last of them to go frees */
+enum { LCHAN_MAX = 1 << 20 };
+
+typedef struct {
+  long seq;
+  lval* value;
+} lchan_slot;
+
+struct lchan {
+  long refs;
+  long closed;
+  long cap;
+  /* Positions of the next recv and send, which only grow */
+  long head;
+  long tail;
+  lchan_slot* slots;
+};
+
+lchan* lchan_new(long cap) {
+  lchan* c = calloc(1, sizeof(lchan));
+  c->refs = 1;
+  c->cap = cap;
+  c->slots = malloc(sizeof(lchan_slot) * cap);
+  for (long i = 0; i != cap; ++i) {
+    c->slots[i].seq = i;
+    c->slots[i].value = NULL;
+  }
+  stats.alloc_bytes += sizeof(lchan) + sizeof(lchan_slot) * cap;
+  return c;
+}
+
+void lchan_retain(lchan* c) { latomic_add(&c->refs, 1); }
+
+/* Values nobody received go with the last copy */
+void lchan_release(lchan* c) {
+  if (latomic_add(&c->refs, -1) != 0) { return; }
+  for (long i = c->head; i != c->tail; ++i) { lval_del(c->slots[i % c->cap].value); }
+  free(c->slots);
+  free(c);
+}
+
+/* Puts v in the channel and returns 1, or returns 0 if it's full. A slot
+   is free to write at position pos once its sequence number is pos */
+int lchan_try_send(lchan* c, lval* v) {
+  long pos = latomic_load(&c->tail);
+  while (1) {
+    lchan_slot* slot = &c->slots[pos % c->cap];
+    long diff = latomic_load(&slot->seq) - pos;
+    if (diff < 0) { return 0; }
+    if (diff == 0 && latomic_cas(&c->tail, pos, pos + 1)) {
+      slot->value = v;
+      latomic_store(&slot->seq, pos + 1);
+      return 1;
+    }
+    pos = latomic_load(&c->tail);
+  }
+}
+
+/* Takes the oldest value out of the channel, or returns NULL if it's
+   empty. A slot is ready to read at pos once its sequence number is pos + 1,
+   and reading it frees it for the send a lap later */
+lval* lchan_try_recv(lchan* c) {
+  long pos = latomic_load(&c->head);
+  while (1) {
+    lchan_slot* slot = &c->slots[pos % c->cap];
+    long diff = latomic_load(&slot->seq) - (pos + 1);
+    if (diff < 0) { return NULL; }
+    if (diff == 0 && latomic_cas(&c->head, pos, pos + 1)) {
+      lval* v = slot->value;
+      latomic_store(&slot->seq, pos + c->cap);
+      return v;
+    }
+    pos = latomic_load(&c->head);
+  }
+}
+
+/* Waits for the event count to move on from 'seen', read before the
+   channels were tried. Returns NULL to try again, or the error to give
+   if nothing could ever change them */
+lval* lchan_wait(linterp* l, long seen, char* op) {
+  linterp* r = linterp_root(l);
+  if (latomic_load(&r->stopping)) {
+    return lval_err("'%s' gave up, the interpreter is stopping.", op);
+  }
+  /* The main thread can tell when nothing else is running */
+  if ((!l->root && !latomic_load(&r->running)) || !threadpool_event_wait(seen)) {
+    return lval_err("'%s' would wait forever, nothing else is running.", op);
+  }
+  return NULL;
+}
+
+/* (chan n) is a new channel holding up to n values */
+lval* builtin_chan(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'chan' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_NUM, "'chan' expects a number.");
+  long n = a->cell[0]->num;
+  LASSERT(a, n > 0 && n <= LCHAN_MAX,
+    "'chan' size must be between 1 and %i, got %li.", LCHAN_MAX, n);
+  lval_del(a);
+
+  lval* v = lval_alloc(LVAL_CHAN);
+  v->chan = lchan_new(n);
+  return v;
+}
+
+/* (send c v) puts v in c, waiting while c is full. Arguments are already
+   the builtin's own, so v is moved in rather than copied */
+lval* builtin_send(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 2, "'send' expects a channel and a value.");
+  LASSERT(a, a->cell[0]->type == LVAL_CHAN, "'send' expects a channel.");
+
+  lchan* c = a->cell[0]->chan;
+  lval* v = lval_pop(a, 1);
+  lval* err = NULL;
+  while (!err) {
+    long seen = threadpool_event();
+    if (latomic_load(&c->closed)) {
+      err = lval_err("'send' to a closed channel.");
+    } else if (lchan_try_send(c, v)) {
+      threadpool_event_notify();
+      lval_del(a);
+      return lval_sexpr();
+    } else {
+      err = lchan_wait(l, seen, "send");
+    }
+  }
+  lval_del(v);
+  lval_del(a);
+  return err;
+}
+
+/* (recv c) takes the oldest value in c, waiting while c is empty. Once c
+   is closed and empty it's an error, or (recv c x) gives x */
+lval* builtin_recv(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "'recv' expects a channel and an optional value for when it's closed.");
+  LASSERT(a, a->cell[0]->type == LVAL_CHAN, "'recv' expects a channel.");
+
+  lchan* c = a->cell[0]->chan;
+  lval* x = NULL;
+  while (!x) {
+    long seen = threadpool_event();
+    /* Closed before the channel was found empty, so it stays empty */
+    long closed = latomic_load(&c->closed);
+    if ((x = lchan_try_recv(c))) {
+      threadpool_event_notify();
+    } else if (closed) {
+      x = a->count == 2 ? lval_pop(a, 1) : lval_err("'recv' from a closed channel.");
+    } else {
+      x = lchan_wait(l, seen, "recv");
+    }
+  }
+  lval_del(a);
+  return x;
+}
+
+/* Where the next select starts looking, so no channel is always first */
+static THREAD_LOCAL unsigned select_turn;
+
+/* (select c0 c1 ...) waits for a value on any of the channels, giving
+   {i value} for the value from channel i. Closed and empty channels are
+   passed over, and it's an error once they all are */
+lval* builtin_select(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count > 0, "'select' expects at least one channel.");
+  for (int i = 0; i != a->count; ++i) {
+    LASSERT(a, a->cell[i]->type == LVAL_CHAN, "'select' expects channels.");
+  }
+
+  int n = a->count;
+  int start = (int)(select_turn++ % (unsigned)n);
+  lval* x = NULL;
+  while (!x) {
+    long seen = threadpool_event();
+    int open = 0;
+    for (int k = 0; k != n && !x; ++k) {
+      int i = (start + k) % n;
+      lchan* c = a->cell[i]->chan;
+      long closed = latomic_load(&c->closed);
+      lval* v = lchan_try_recv(c);
+      if (v) {
+        threadpool_event_notify();
+        x = lval_add(lval_add(lval_qexpr(), lval_num(i)), v);
+      } else if (!closed) {
+        open++;
+      }
+    }
+    if (x) { break; }
+    x = open ? lchan_wait(l, seen, "select")
+      : lval_err("'select' found every channel closed.");
+  }
+  lval_del(a);
+  return x;
+}
+
+/* (close c) stops sends to c. What's in it can still be received */
+lval* builtin_close(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'close' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_CHAN, "'close' expects a channel.");
+  latomic_store(&a->cell[0]->chan->closed, 1);
+  threadpool_event_notify();
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* (closed? c) is true once c is closed and empty, when recv would fail */
+lval* builtin_closedp(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'closed?' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_CHAN, "'closed?' expects a channel.");
+  lchan* c = a->cell[0]->chan;
+  bool done = latomic_load(&c->closed)
+    && latomic_load(&c->head) == latomic_load(&c->tail);
+  lval_del(a);
+  return lval_bool(done);
+}
+
+/* Processes. (process {expr}) evaluates expr on a thread of its own, in
+   a context over a snapshot of the environment as a future's is, and
+   returns at once. A process waiting on a channel holds its thread, so
+   the pool starts a thread for each process with none idle to take it,
+   and keeps them to run later processes. Nothing waits for a process:
+   errors are printed, and the value is dropped */
+typedef struct {
+  linterp ctx;
+  lval* expr;
+} lprocess;
+
+static void lprocess_run(void* arg) {
+  lprocess* p = arg;
+  linterp* r = p->ctx.root;
+  lstats saved = stats;
+
+  /* Processes queued as the interpreter stops aren't started */
+  if (!latomic_load(&r->stopping)) {
+    lval* x = lval_eval(&p->ctx, p->ctx.env, p->expr);
+    if (x->type == LVAL_ERR && !latomic_load(&r->stopping)) { lval_println(x); }
+    lval_del(x);
+  } else {
+    lval_del(p->expr);
+  }
+
+  lenv_del(p->ctx.env);
+  load_cache_free(&p->ctx);
+  free(p);
+  stats = saved;
+
+  latomic_add(&r->running, -1);
+  threadpool_event_notify();
+}
+
+threadpool* linterp_procs(linterp* l) {
+  linterp* r = linterp_root(l);
+  lspin_lock(&r->lock);
+  if (!r->procs) { r->procs = threadpool_new_growing(mpc_thread_cleanup); }
+  lspin_unlock(&r->lock);
+  return r->procs;
+}
+
+lval* builtin_process(linterp* l, lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "'process' expects 1 argument.");
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "'process' expects a Q-Expression.");
+#ifdef _WIN32
+  LASSERT(a, false, "'process' needs threads, which this build doesn't have.");
+#endif
+
+  lprocess* p = malloc(sizeof(lprocess));
+  linterp_fork(l, e, &p->ctx);
+  p->expr = lval_take(a, 0);
+  p->expr->type = LVAL_SEXPR;
+
+  threadpool* procs = linterp_procs(l);
+  latomic_add(&p->ctx.root->running, 1);
+  threadpool_detach(procs, threadpool_submit(procs, lprocess_run, p));
+  return lval_sexpr();
+}
+
+void lenv_add_builtins(linterp* l) {
+  /* List Functions */
+  lenv_add_builtin(l, "cons", builtin_cons);
+  lenv_add_builtin(l, "list", builtin_list);
+  lenv_add_builtin(l, "head", builtin_head);
+  lenv_add_builtin(l, "tail", builtin_tail);
+  lenv_add_builtin(l, "eval", builtin_eval);
+  lenv_add_builtin(l, "join", builtin_join);
+  lenv_add_builtin(l, "init", builtin_init);
+  lenv_add_builtin(l, "map", builtin_map);
+  lenv_add_builtin(l, "filter", builtin_filter);
+  lenv_add_builtin(l, "foldl", builtin_foldl);
+  lenv_add_builtin(l, "range", builtin_range);
+  lenv_add_builtin(l, "len", builtin_len);
+  lenv_add_builtin(l, "sort", builtin_sort);
+  lenv_add_builtin(l, "memoize", builtin_memoize);
+  lenv_add_builtin(l, "memo-stats", builtin_memo_stats);
+  /* Lazy sequences */
+  lenv_add_builtin(l, "seq", builtin_seq);
+  lenv_add_builtin(l, "seq-range", builtin_seq_range);
+  lenv_add_builtin(l, "lines-of-file", builtin_lines_of_file);
+  lenv_add_builtin(l, "take", builtin_take);
+  lenv_add_builtin(l, "drop", builtin_drop);
+  lenv_add_builtin(l, "for-each", builtin_for_each);
+  lenv_add_builtin(l, "collect", builtin_collect);
+  /* Variable functions */
+  lenv_add_builtin(l, "def", builtin_def);
+  lenv_add_builtin(l, "=",   builtin_put);
+  lenv_add_builtin(l, "\\", builtin_lambda);
+  lenv_add_builtin(l, "if", builtin_if);
+  /* Mathematical Functions */
+  lenv_add_builtin(l, "+", builtin_add);
+  lenv_add_builtin(l, "-", builtin_sub);
+  lenv_add_builtin(l, "*", builtin_mul);
+  lenv_add_builtin(l, "/", builtin_div);
+  lenv_add_builtin(l, "%", builtin_mod);
+  lenv_add_builtin(l, "^", builtin_pow);
+  /* Comparisons */
+  lenv_add_builtin(l, "eqv?", builtin_eqv);
+  lenv_add_builtin(l, "<", builtin_lt);
+  lenv_add_builtin(l, ">", builtin_gt);
+  lenv_add_builtin(l, "=", builtin_eq);
+  lenv_add_builtin(l, "!=", builtin_neq);
+  lenv_add_builtin(l, ">=", builtin_geq);
+  lenv_add_builtin(l, "<=", builtin_leq);
+
+lenv_add_builtin(l, "load",  builtin_load);
+  lenv_add_builtin(l, "load-cache-clear", builtin_load_cache_clear);
+  lenv_add_builtin(l, "load-cache-stats", builtin_load_cache_stats);
+  lenv_add_builtin(l, "to-string", builtin_to_string);
+  lenv_add_builtin(l, "profile-start", builtin_profile_start);
+  lenv_add_builtin(l, "profile-stop", builtin_profile_stop);
+  lenv_add_builtin(l, "stats", builtin_stats);
+  lenv_add_builtin(l, "dump", builtin_dump);
+  lenv_add_builtin(l, "undump", builtin_undump);
+  lenv_add_builtin(l, "save-image", builtin_save_image);
+  lenv_add_builtin(l, "pmap", builtin_pmap);
+  lenv_add_builtin(l, "preduce", builtin_preduce);
+  lenv_add_builtin(l, "workers", builtin_workers);
+  lenv_add_builtin(l, "spawn", builtin_spawn);
+  lenv_add_builtin(l, "await", builtin_await);
+  lenv_add_builtin(l, "chan", builtin_chan);
+  lenv_add_builtin(l, "send", builtin_send);
+  lenv_add_builtin(l, "recv", builtin_recv);
+  lenv_add_builtin(l, "select", builtin_select);
+  lenv_add_builtin(l, "close", builtin_close);
+  lenv_add_builtin(l, "closed?", builtin_closedp);
+  lenv_add_builtin(l, "process", builtin_process);
+
+  // TODO: Boolean functions, and, or, not
+}
+
+lval* lval_eval_sexpr(linterp* l, lenv* e, lval* v) {
+
+  /* Evaluate Children */
+  for (int i = 0; i < v->count; i++) {
+    v->cell[i] = lval_eval(l, e, v->cell[i]);
+  }
+
+  /* Error Checking */
+  for (int i = 0; i < v->count; i++) {
+    if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+  }
+
+  /* Empty Expression */
+  if (v->count == 0) { return v; }
+
+  /* Single Expression */
+  if (v->count == 1) { return lval_take(v, 0); }
+
+  /* Ensure First Element is Symbol */
+  lval* f = lval_pop(v, 0);
+  if (f->type != LVAL_FUN) {
+    lval_del(f); lval_del(v);
+    return lval_err("first element is not a function!");
+  }
+
+  /* Call builtin with operator */
+  prof_frame replaced = prof_push(l, f);
+  lval* result = lval_call(l, e, f, v);
+  prof_pop(l, replaced);
+  lval_del(f);
+  return result;
+}
+
+/* S-Expressions being evaluated on this thread. Evaluation recurses on
+   the C stack, so past EVAL_DEPTH_MAX it stops with an error rather than
+   overflowing it. The limit leaves room on an 8MB stack, which workers
+   are given, for the deepest path, a lambda calling itself */
+enum { EVAL_DEPTH_MAX = 16000 };
+THREAD_LOCAL int eval_depth;
+
+lval* lval_eval(linterp* l, lenv* e, lval* v) {
+  /* Evaluate symbols */
+  if (v->type == LVAL_SYM) {
+    lval* x = lenv_get(e, v);
+    lval_del(v);
+    return x;
+  }
+  /* Evaluate Sexpressions */
+  if (v->type == LVAL_SEXPR) {
+    if (eval_depth == EVAL_DEPTH_MAX) {
+      lval_del(v);
+      return lval_err("Maximum evaluation depth exceeded!");
+    }
+    eval_depth++;
+    lval* x = lval_eval_sexpr(l, e, v);
+    eval_depth--;
+    return x;
+  }
+  /* All other lval types remain the same */
+  return v;
+}
+
+
+typedef struct {
+  linterp* l;
+  char* filename;
+  lval* expr;
+  load_entry* entry;
+  lstats stats;
+} load_job;
+
+/* Counts the parse separately, since it may run on another thread */
+static void load_job_run(void* arg) {
+  load_job* job = arg;
+  lstats saved = stats;
+  memset(&stats, 0, sizeof(stats));
+  job->expr = lval_read_file(job->l, job->filename);
+  job->stats = stats;
+  stats = saved;
+}
+
+/* Parses the files in parallel, but evaluates them in order on this thread */
+void load_files(linterp* l, int count, char** filenames) {
+  /* This thread parses too while it waits, so it counts as a worker */
+  int workers = threadpool_cpus() - 1;
+  if (workers > count - 1) { workers = count - 1; }
+
+  threadpool* pool = threadpool_new(workers, mpc_thread_cleanup);
+  load_job* jobs = malloc(sizeof(load_job) * count);
+  tp_task** tasks = malloc(sizeof(tp_task*) * count);
+
+  /* Only files missing from the cache go to the pool */
+  for (int i = 0; i != count; ++i) {
+    jobs[i].l = l;
+    jobs[i].filename = filenames[i];
+    jobs[i].entry = NULL;
+    jobs[i].expr = NULL;
+    tasks[i] = NULL;
+    /* Binary files are read as they're evaluated */
+    if (lbin_is_binary(filenames[i])) { continue; }
+
+    jobs[i].entry = load_cache_lookup(l, filenames[i]);
+    if (jobs[i].entry && jobs[i].entry->forms) {
+      jobs[i].expr = lval_copy(jobs[i].entry->forms);
+    } else {
+      tasks[i] = threadpool_submit(pool, load_job_run, &jobs[i]);
+    }
+  }
+
+  for (int i = 0; i != count; ++i) {
+    if (tasks[i]) {
+      threadpool_wait(pool, tasks[i]);
+      lstats_add(&stats, &jobs[i].stats);
+      load_cache_store(jobs[i].entry, jobs[i].expr);
+    }
+
+    lval* x = jobs[i].expr
+      ? lval_load(l, l->env, jobs[i].expr)
+      : lval_load_binary(l, l->env, filenames[i]);
+
+    if (x->type == LVAL_ERR) { lval_println(x); }
+    lval_del(x);
+  }
+
+  free(tasks);
+  free(jobs);
+  threadpool_del(pool);
+}
+
+/* A new interpreter with its own parsers and a global environment holding
+   the builtins */
+linterp* linterp_new(void) {
+  linterp* l = calloc(1, sizeof(linterp));
+  l->workers = -1;
+
+  /* Create Some Parsers */
+  l->Number = mpc_new("number");
+  l->String = mpc_new("string");
+  l->Boolean = mpc_new("boolean");
+  l->Comment = mpc_new("comment");
+  l->Symbol = mpc_new("symbol");
+  l->Sexpr = mpc_new("sexpr");
+  l->Qexpr = mpc_new("qexpr");
+  l->Expr = mpc_new("expr");
+  l->Lispy = mpc_new("lispy");
+
+  /* Define them from the precompiled grammar, or compile it if that fails */
+  mpc_err_t* err = mpc_load(grammar_image, grammar_image_len, 9,
+	    l->Number, l->String, l->Comment, l->Boolean, l->Symbol,
+	    l->Sexpr, l->Qexpr, l->Expr, l->Lispy);
+  if (err) {
+    mpc_err_delete(err);
+    mpca_lang(MPCA_LANG_RULE_IDS, grammar_source,
+	      l->Number, l->String, l->Comment, l->Boolean, l->Symbol,
+	      l->Sexpr, l->Qexpr, l->Expr, l->Lispy);
+  }
+
+  linterp_enter(l);
+  l->env = lenv_top(ltrie_new());
+  lenv_add_builtins(l);
+  linterp_leave(l);
+  return l;
+}
+
+void linterp_del(linterp* l) {
+  /* Processes waiting on channels give up, the rest run to the end */
+  if (l->procs) {
+    latomic_store(&l->stopping, 1);
+    threadpool_event_notify();
+    threadpool_del(l->procs);
+  }
+
+  linterp_enter(l);
+  if (prof.target == l) { prof_free(); }
+  lenv_del(l->env);
+  load_cache_free(l);
+  free(l->builtins.names);
+  free(l->builtins.funcs);
+  lval_names_free(l);
+  linterp_leave(l);
+  if (l->pool) { threadpool_del(l->pool); }
+
+  /* Undefine and Delete our Parsers */
+  mpc_cleanup(9, l->Number, l->String, l->Comment, l->Boolean, l->Symbol,
+    l->Sexpr, l->Qexpr, l->Expr, l->Lispy);
+  free(l);
+}
+
+/* The library's interface, see clispy.h. Each call that runs code enters
+   the interpreter so its counters are kept */
+clispy* clispy_new(void) { return linterp_new(); }
+
+void clispy_free(clispy* c) { linterp_del(c); }
+
+void clispy_thread_cleanup(void) { mpc_thread_cleanup(); }
+
+void clispy_register(clispy* c, const char* name, clispy_builtin fn) {
+  linterp_enter(c);
+  /* The registry keeps the name, so give it one that lasts */
+  lenv_add_builtin(c, lval_name_intern(c, (char*)name), fn);
+  linterp_leave(c);
+}
+
+clispy_value* clispy_read(clispy* c, const char* filename,
+  const char* source, size_t length) {
+  linterp_enter(c);
+  mpc_result_t r;
+  lval* x;
+  if (lispy_parse(c, filename, source, length, &r)) {
+    x = lval_read(r.output);
+    mpc_ast_delete(r.output);
+  } else {
+    /* Keep the whole message, which lval_err would cut short, without
+       the newline mpc ends it with */
+    x = lval_alloc(LVAL_ERR);
+    x->err = mpc_err_string(r.error);
+    size_t n = strlen(x->err);
+    if (n && x->err[n - 1] == '\n') { x->err[n - 1] = '\0'; }
+    mpc_err_delete(r.error);
+  }
+  linterp_leave(c);
+  return x;
+}
+
+clispy_value* clispy_eval(clispy* c, clispy_value* v) {
+  linterp_enter(c);
+  lval* x = lval_eval(c, c->env, v);
+  linterp_leave(c);
+  return x;
+}
+
+/* Evaluates forms, which it takes, stopping at the first error */
+static lval* clispy_eval_forms(clispy* c, lval* forms) {
+  if (forms->type == LVAL_ERR) { return forms; }
+
+  lval* x = lval_sexpr();
+  while (forms->count && x->type != LVAL_ERR) {
+    lval_del(x);
+    x = lval_eval(c, c->env, lval_pop(forms, 0));
+  }
+  lval_del(forms);
+  return x;
+}
+
+clispy_value* clispy_eval_string(clispy* c, const char* source) {
+  lval* forms = clispy_read(c, "<string>", source, strlen(source));
+  linterp_enter(c);
+  lval* x = clispy_eval_forms(c, forms);
+  linterp_leave(c);
+  return x;
+}
+
+clispy_value* clispy_eval_file(clispy* c, const char* filename) {
+  linterp_enter(c);
+  lval* x;
+
+  if (lbin_is_binary((char*)filename)) {
+    lbin_reader r;
+    x = lbin_reader_open(c, &r, (char*)filename, LBIN_MAGIC);
+    if (x == NULL) {
+      x = lval_sexpr();
+      lval* v;
+      while (x->type != LVAL_ERR && (v = lbin_read(&r))) {
+        if (v->type == LVAL_QEXPR) { v->type = LVAL_SEXPR; }
+        lval_del(x);
+        x = lval_eval(c, c->env, v);
+      }
+      if (r.corrupt && x->type != LVAL_ERR) {
+        lval_del(x);
+        x = lbin_reader_err(&r, "binary file", filename);
+      }
+      lbin_reader_close(&r);
+    }
+  } else {
+    x = clispy_eval_forms(c, lval_read_cached(c, (char*)filename));
+  }
+
+  linterp_leave(c);
+  return x;
+}
+
+void clispy_load_files(clispy* c, int count, char** filenames) {
+  linterp_enter(c);
+  load_files(c, count, filenames);
+  linterp_leave(c);
+}
+
+clispy_value* clispy_load_image(clispy* c, const char* filename) {
+  linterp_enter(c);
+  lval* err = lenv_load_image(c, c->env, (char*)filename);
+  linterp_leave(c);
+  return err;
+}
+
+void clispy_set_workers(clispy* c, int workers) {
+  if (workers < 0) { workers = 0; }
+  if (workers > PMAP_MAX_WORKERS) { workers = PMAP_MAX_WORKERS; }
+  linterp_set_workers(c, workers);
+}
+
+void clispy_set_max_depth(int depth) {
+  if (depth < 0) { depth = 0; }
+  read_depth_max = depth;
+  if (depth == 0 || depth > (INT_MAX - PARSE_FRAMES_BASE) / PARSE_FRAMES_PER_LEVEL) {
+    mpc_set_max_depth(0);
+  } else {
+    mpc_set_max_depth(depth * PARSE_FRAMES_PER_LEVEL + PARSE_FRAMES_BASE);
+  }
+}
+
+void clispy_print_stats(clispy* c) {
+  stats_print(c->entered ? &stats : &c->stats);
+}
+
+clispy_type clispy_value_type(const clispy_value* v) { return (clispy_type)v->type; }
+
+long clispy_number(const clispy_value* v) { return v->type == LVAL_NUM ? v->num : 0; }
+
+int clispy_bool(const clispy_value* v) { return v->type == LVAL_BOOL && v->boolean; }
+
+const char* clispy_text(const clispy_value* v) {
+  switch (v->type) {
+    case LVAL_STR: return v->string;
+    case LVAL_SYM: return v->sym;
+    case LVAL_ERR: return v->err;
+    default: return NULL;
+  }
+}
+
+int clispy_count(const clispy_value* v) {
+  return v->type == LVAL_SEXPR || v->type == LVAL_QEXPR ? v->count : 0;
+}
+
+clispy_value* clispy_item(clispy_value* v, int i) { return v->cell[i]; }
+
+clispy_value* clispy_pop(clispy_value* v, int i) { return lval_pop(v, i); }
+
+clispy_value* clispy_number_new(long x) { return lval_num(x); }
+
+clispy_value* clispy_bool_new(int b) { return lval_bool(b != 0); }
+
+clispy_value* clispy_string_new(const char* s) { return lval_str((char*)s); }
+
+clispy_value* clispy_symbol_new(const char* s) { return lval_sym((char*)s); }
+
+clispy_value* clispy_error_new(const char* fmt, ...) {
+  char buffer[512];
+  va_list va;
+  va_start(va, fmt);
+  vsnprintf(buffer, sizeof(buffer), fmt, va);
+  va_end(va);
+  return lval_err("%s", buffer);
+}
+
+clispy_value* clispy_list_new(void) { return lval_qexpr(); }
+
+clispy_value* clispy_list_add(clispy_value* list, clispy_value* x) {
+  return lval_add(list, x);
+}
+
+clispy_value* clispy_value_copy(const clispy_value* v) { return lval_copy((lval*)v); }
+
+void clispy_value_free(clispy_value* v) { lval_del(v); }
+
+void clispy_print(const clispy_value* v) { lval_print((lval*)v); }
+
+void clispy_println(const clispy_value* v) { lval_println((lval*)v); }
+
+char* clispy_to_string(const clispy_value* v) {
+  lbuf b = lbuf_new(NULL, -1);
+  lval_write(&b, (lval*)v);
+  return lbuf_take(&b);
+}
@@ -0,0 +1,116 @@
+#ifndef CLISPY_H
+#define CLISPY_H
+
+#include <stddef.h>
+
+#if defined(_WIN32) && defined(CLISPY_SHARED)
+#define CLISPY_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define CLISPY_API __attribute__((visibility("default")))
+#else
+#define CLISPY_API
+#endif
+
+/* An interpreter, with its own global environment. Interpreters are
+   independent, so different threads can each run their own, but one
+   interpreter must only be used by one thread at a time. Freeing it waits
+   for its processes, which give up any wait on a channel */
+typedef struct linterp clispy;
+
+/* A value. Functions that return one give it to the caller, who frees it
+   with clispy_value_free or passes it on to a function that takes it */
+typedef struct lval clispy_value;
+
+/* The environment a builtin was called in */
+typedef struct lenv clispy_env;
+
+typedef enum {
+  CLISPY_NUMBER, CLISPY_ERROR, CLISPY_FUNCTION, CLISPY_BOOL,
+  CLISPY_STRING, CLISPY_SYMBOL, CLISPY_SEXPR, CLISPY_QEXPR, CLISPY_FUTURE,
+  CLISPY_CHANNEL, CLISPY_SEQUENCE
+} clispy_type;
+
+/* A builtin written in C. It owns 'args', a Q-Expression of the evaluated
+   arguments, and must free it or return it. It returns its result, or an
+   error from clispy_error_new */
+typedef clispy_value* (*clispy_builtin)(clispy* c, clispy_env* e, clispy_value* args);
+
+CLISPY_API clispy* clispy_new(void);
+CLISPY_API void clispy_free(clispy* c);
+
+/* Frees the parser memory the calling thread keeps for its next parse. A
+   thread which used the library should call it before it exits */
+CLISPY_API void clispy_thread_cleanup(void);
+
+/* Binds a builtin to a name in the global environment. Images and binary
+   files refer to builtins by this name */
+CLISPY_API void clispy_register(clispy* c, const char* name, clispy_builtin fn);
+
+/* Parses source into an S-Expression of its forms, or an error holding
+   the parser's message */
+CLISPY_API clispy_value* clispy_read(clispy* c, const char* filename,
+  const char* source, size_t length);
+
+/* Evaluates v, which it takes, in the global environment */
+CLISPY_API clispy_value* clispy_eval(clispy* c, clispy_value* v);
+
+/* Evaluates each form in source in turn. Returns the last one's value or
+   the first error */
+CLISPY_API clispy_value* clispy_eval_string(clispy* c, const char* source);
+
+/* The same for a file, which may be source or .clispb. Files are cached
+   as they are for load */
+CLISPY_API clispy_value* clispy_eval_file(clispy* c, const char* filename);
+
+/* Loads files as the load builtin does, printing errors as it goes. The
+   files are parsed in parallel and evaluated in order */
+CLISPY_API void clispy_load_files(clispy* c, int count, char** filenames);
+
+/* Adds the environment saved by save-image to the global environment.
+   Returns NULL, or an error */
+CLISPY_API clispy_value* clispy_load_image(clispy* c, const char* filename);
+
+/* Sets the number of threads pmap, preduce and spawn use besides the
+   caller's. The default is one per spare processor. It has no effect while
+   futures are pending or processes running */
+CLISPY_API void clispy_set_workers(clispy* c, int workers);
+
+/* Limits how deeply lists may nest in the source and binary files read,
+   zero for no limit. The default is 120000. Values are copied and freed
+   recursively, so going much deeper needs a bigger stack. The limit is
+   shared by every interpreter, so set it before any of them run */
+CLISPY_API void clispy_set_max_depth(int depth);
+
+/* Writes the interpreter's counters to stderr, as --stats does */
+CLISPY_API void clispy_print_stats(clispy* c);
+
+/* Values */
+CLISPY_API clispy_type clispy_value_type(const clispy_value* v);
+CLISPY_API long clispy_number(const clispy_value* v);
+CLISPY_API int clispy_bool(const clispy_value* v);
+/* The text of a string, symbol or error */
+CLISPY_API const char* clispy_text(const clispy_value* v);
+/* The items of an S-Expression or Q-Expression. clispy_item lends the
+   item, clispy_pop removes it and gives it to the caller */
+CLISPY_API int clispy_count(const clispy_value* v);
+CLISPY_API clispy_value* clispy_item(clispy_value* v, int i);
+CLISPY_API clispy_value* clispy_pop(clispy_value* v, int i);
+
+CLISPY_API clispy_value* clispy_number_new(long x);
+CLISPY_API clispy_value* clispy_bool_new(int b);
+CLISPY_API clispy_value* clispy_string_new(const char* s);
+CLISPY_API clispy_value* clispy_symbol_new(const char* s);
+CLISPY_API clispy_value* clispy_error_new(const char* fmt, ...);
+/* An empty Q-Expression */
+CLISPY_API clispy_value* clispy_list_new(void);
+/* Appends x, which it takes, to the list and returns the list */
+CLISPY_API clispy_value* clispy_list_add(clispy_value* list, clispy_value* x);
+CLISPY_API clispy_value* clispy_value_copy(const clispy_value* v);
+CLISPY_API void clispy_value_free(clispy_value* v);
+
+/* Prints v as the REPL does, or returns the text for the caller to free */
+CLISPY_API void clispy_print(const clispy_value* v);
+CLISPY_API void clispy_println(const clispy_value* v);
+CLISPY_API char* clispy_to_string(const clispy_value* v);
+
+#endif
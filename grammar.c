@@ -0,0 +1,15 @@
+#include "grammar.h"
+
+/* The language, as given to mpca_lang */
+const char* grammar_source =
+"\
+	    number   : /-?[0-9]+/ ; \
+      string   : /\"(\\\\.|[^\"])*\"/ ;  \
+      comment  : /;[^\\r\\n]*/ ; \
+      boolean  : /#[tf]/  ; \
+	    symbol   : /[\\^\\\%a-zA-Z0-9_+\\-*\\/\\\\=<>!&\\?]+/ ;         \
+      sexpr    : '(' <expr>* ')' ; \
+      qexpr    : '{' <expr>* '}' ; \
+	    expr     : <number> | <string> | <comment> | <boolean> | <symbol> | <sexpr> | <qexpr> ; \
+	    lispy    : /^/ <expr>* /$/ ; \
+	    ";
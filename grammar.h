@@ -0,0 +1,19 @@
+#ifndef CLISPY_GRAMMAR_H
+#define CLISPY_GRAMMAR_H
+
+#include <stddef.h>
+
+/* Rule ids, numbered by the parsers' position in the arguments to mpca_lang */
+enum {
+  RULE_NUMBER = 1, RULE_STRING, RULE_COMMENT, RULE_BOOLEAN, RULE_SYMBOL,
+  RULE_SEXPR, RULE_QEXPR, RULE_EXPR, RULE_LISPY
+};
+
+/* The language, in mpca_lang's syntax */
+extern const char* grammar_source;
+
+/* The same language compiled ahead of time by mkgrammar, see mpc_load */
+extern const unsigned char grammar_image[];
+extern const size_t grammar_image_len;
+
+#endif
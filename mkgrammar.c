@@ -0,0 +1,51 @@
+/* Compiles the grammar at build time and writes it out as grammar_image.c */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mpc.h"
+#include "grammar.h"
+
+int main(void) {
+  mpc_parser_t* Number = mpc_new("number");
+  mpc_parser_t* String = mpc_new("string");
+  mpc_parser_t* Boolean = mpc_new("boolean");
+  mpc_parser_t* Comment = mpc_new("comment");
+  mpc_parser_t* Symbol = mpc_new("symbol");
+  mpc_parser_t* Sexpr = mpc_new("sexpr");
+  mpc_parser_t* Qexpr = mpc_new("qexpr");
+  mpc_parser_t* Expr = mpc_new("expr");
+  mpc_parser_t* Lispy = mpc_new("lispy");
+
+  mpc_err_t* err = mpca_lang(MPCA_LANG_RULE_IDS, grammar_source,
+    Number, String, Comment, Boolean, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  if (err) {
+    mpc_err_print_to(err, stderr);
+    mpc_err_delete(err);
+    return 1;
+  }
+
+  /* Save into a scratch file then copy that out as a C array */
+  FILE* tmp = tmpfile();
+  if (!tmp || !mpc_save(tmp, 9, Number, String, Comment, Boolean, Symbol, Sexpr, Qexpr, Expr, Lispy)) {
+    fputs("mkgrammar: could not save the grammar\n", stderr);
+    return 1;
+  }
+  rewind(tmp);
+
+  puts("/* Generated by mkgrammar from grammar.c, do not edit */");
+  puts("#include \"grammar.h\"\n");
+  puts("const unsigned char grammar_image[] = {");
+
+  size_t len = 0;
+  int c;
+  while ((c = fgetc(tmp)) != EOF) {
+    printf("%s0x%02x,", len % 12 == 0 ? (len ? "\n  " : "  ") : " ", c);
+    len++;
+  }
+
+  printf("\n};\n\nconst size_t grammar_image_len = %zu;\n", len);
+
+  fclose(tmp);
+  mpc_cleanup(9, Number, String, Comment, Boolean, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  return 0;
+}
@@ -71,10 +71,42 @@ enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
-typedef struct {
+/* Slots are big enough for an error, the most common small object */
+typedef union mpc_mem_t {
+  union mpc_mem_t *next;
+  mpc_err_t err;
   char mem[64];
 } mpc_mem_t;
 
+/*
+** AST Arena
+*/
+
+enum {
+  MPC_AST_BLOCK_MIN = 4096,
+  MPC_AST_BLOCK_MAX = 65536
+};
+
+typedef union {
+  void *p;
+  long l;
+  double d;
+} mpc_ast_align_t;
+
+typedef struct mpc_ast_block_t {
+  struct mpc_ast_block_t *next;
+  size_t used;
+  size_t size;
+} mpc_ast_block_t;
+
+#define MPC_AST_ALIGN(n) (((n) + sizeof(mpc_ast_align_t) - 1) / sizeof(mpc_ast_align_t) * sizeof(mpc_ast_align_t))
+
+typedef struct mpc_ast_arena_t {
+  mpc_ast_block_t *block;
+  mpc_ast_t *root;
+  int foreign;
+} mpc_ast_arena_t;
+
 typedef struct {
 
   int type;
@@ -94,125 +126,113 @@ typedef struct {
   char *lasts;
   char last;
 
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
+  mpc_mem_t *mem_free;
+  size_t mem_used;
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
+  mpc_ast_arena_t *arena;
+
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+/*
+** Small allocations made while parsing come from the input's pool of
+** fixed size slots. Freed slots go on a free list and fresh ones are
+** bumped off the end of the pool, so nothing needs clearing up front and
+** an allocation never searches. Anything still held in the pool once the
+** parse is over has been exported or is garbage, so an input can be
+** recycled just by resetting the pool. Each thread keeps one deleted
+** input aside to be reused by its next parse.
+*/
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define MPC_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define MPC_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define MPC_THREAD_LOCAL __declspec(thread)
+#endif
+
+#ifdef MPC_THREAD_LOCAL
+static MPC_THREAD_LOCAL mpc_input_t *mpc_input_spare = NULL;
+#endif
+
+static mpc_input_t *mpc_input_alloc(const char *filename) {
+
+  mpc_input_t *i = NULL;
+
+#ifdef MPC_THREAD_LOCAL
+  i = mpc_input_spare;
+  mpc_input_spare = NULL;
+#endif
+
+  if (i == NULL) {
+    i = malloc(sizeof(mpc_input_t));
+    i->marks_slots = MPC_INPUT_MARKS_MIN;
+    i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+    i->lasts = malloc(sizeof(char) * i->marks_slots);
+  }
 
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
 
   i->state = mpc_state_new();
 
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = NULL;
   i->buffer = NULL;
   i->file = NULL;
 
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mem_free = NULL;
+  i->mem_used = 0;
+  i->arena = NULL;
 
   return i;
 }
 
-static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i = mpc_input_alloc(filename);
 
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
   i->type = MPC_INPUT_STRING;
+  i->string = malloc(strlen(string) + 1);
+  strcpy(i->string, string);
 
-  i->state = mpc_state_new();
+  return i;
+}
+
+static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+
+  mpc_input_t *i = mpc_input_alloc(filename);
 
+  i->type = MPC_INPUT_STRING;
   i->string = malloc(length + 1);
   strncpy(i->string, string, length);
   i->string[length] = '\0';
-  i->buffer = NULL;
-  i->file = NULL;
-
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
   return i;
-
 }
 
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
+  mpc_input_t *i = mpc_input_alloc(filename);
 
   i->type = MPC_INPUT_PIPE;
-  i->state = mpc_state_new();
-
-  i->string = NULL;
-  i->buffer = NULL;
   i->file = pipe;
 
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-
   return i;
-
 }
 
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i = mpc_input_alloc(filename);
 
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
   i->type = MPC_INPUT_FILE;
-  i->state = mpc_state_new();
-
-  i->string = NULL;
-  i->buffer = NULL;
   i->file = file;
 
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-
   return i;
 }
 
@@ -223,33 +243,44 @@ static void mpc_input_delete(mpc_input_t *i) {
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
 
+#ifdef MPC_THREAD_LOCAL
+  if (mpc_input_spare == NULL) { mpc_input_spare = i; return; }
+#endif
+
+  free(i->marks);
+  free(i->lasts);
+  free(i);
+}
+
+void mpc_thread_cleanup(void) {
+#ifdef MPC_THREAD_LOCAL
+  mpc_input_t *i = mpc_input_spare;
+  mpc_input_spare = NULL;
+  if (i == NULL) { return; }
   free(i->marks);
   free(i->lasts);
   free(i);
+#endif
 }
 
 static int mpc_mem_ptr(mpc_input_t *i, void *p) {
   return
     (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+    (char*)p <  (char*)(i->mem + i->mem_used);
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
+  mpc_mem_t *p;
 
   if (n > sizeof(mpc_mem_t)) { return malloc(n); }
 
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+  if (i->mem_free) {
+    p = i->mem_free;
+    i->mem_free = p->next;
+    return p;
+  }
+
+  if (i->mem_used < MPC_INPUT_MEM_NUM) { return i->mem + i->mem_used++; }
 
   return malloc(n);
 }
@@ -261,10 +292,10 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
+  mpc_mem_t *q = p;
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  q->next = i->mem_free;
+  i->mem_free = q;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
@@ -597,14 +628,12 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+static const char *mpc_err_char_unescape(char c, char *buffer) {
 
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
-  char_unescape_buffer[3] = '\0';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
 
   switch (c) {
     case '\a': return "bell";
@@ -617,8 +646,8 @@ static const char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
 
 }
@@ -628,6 +657,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int i;
   int pos = 0;
   int max = 1023;
+  char unescaped[4];
   char *buffer = calloc(1, 1024);
 
   if (x->failure) {
@@ -653,7 +683,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
 
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->recieved, unescaped));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
 
   return realloc(buffer, strlen(buffer) + 1);
@@ -928,7 +958,7 @@ typedef struct { mpc_parser_t *x; mpc_check_with_t f; void *d; char *e; } mpc_pd
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned long *predict; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 
 typedef union {
@@ -956,6 +986,8 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  char pooled;
+  int rule;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -987,6 +1019,9 @@ static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
   return a;
 }
 
+static mpc_ast_t *mpc_ast_arena_node(mpc_ast_arena_t *m, const char *tag, const char *contents);
+static mpc_val_t *mpc_ast_fold(mpc_ast_arena_t *m, int n, mpc_val_t **xs);
+
 static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
   int j;
   if (f == mpcf_null)      { return mpcf_null(n, xs); }
@@ -998,6 +1033,7 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
   if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
   if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+  if (f == mpcf_fold_ast)  { return mpc_ast_fold(i->arena, n, xs); }
   for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
   return f(j, xs);
 }
@@ -1008,7 +1044,7 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
 }
 
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = i->arena ? mpc_ast_arena_node(i->arena, "", c) : mpc_ast_new("", c);
   mpc_free(i, c);
   return a;
 }
@@ -1025,6 +1061,8 @@ static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t
 
 static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   if (d == free) { mpc_free(i, x); return; }
+  /* Exporting would copy a pooled value out for nothing to free */
+  if (d == mpcf_dtor_null) { return; }
   d(mpc_export(i, x));
 }
 
@@ -1032,18 +1070,85 @@ enum {
   MPC_PARSE_STACK_MIN = 4
 };
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
+enum {
+  MPC_PREDICT_MAX = 32
+};
+
+/*
+** The parser runs on an explicit stack of frames rather
+** than the C stack, so deeply nested input is limited only
+** by `mpc_set_max_depth` (the maximum number of nested
+** frames, or zero for no limit) and fails cleanly past it.
+**
+** Frames live in linked chunks so their addresses stay put
+** while children write their results into them. A frame
+** which calls a child records a `stage` to resume from, and
+** the child's success is passed back in `ok`.
+*/
+
+enum {
+  MPC_PARSE_CHUNK = 128,
+  MPC_PARSE_DEPTH_DEFAULT = 1 << 21
+};
+
+static int mpc_parse_depth_max = MPC_PARSE_DEPTH_DEFAULT;
+
+void mpc_set_max_depth(int depth) {
+  mpc_parse_depth_max = depth;
+}
+
+typedef struct {
+  mpc_parser_t *p;
+  mpc_result_t *r;
+  mpc_result_t *results;
+  unsigned long predict;
+  int j;
+  int slots;
+  int stage;
+  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+} mpc_frame_t;
+
+typedef struct mpc_frame_chunk_t {
+  struct mpc_frame_chunk_t *prev;
+  struct mpc_frame_chunk_t *next;
+  mpc_frame_t frames[MPC_PARSE_CHUNK];
+} mpc_frame_chunk_t;
+
+#define MPC_CALL(q, dst, s) f->stage = s; call_p = q; call_r = dst; goto call
+#define MPC_SUCCESS(x) r->output = x; ok = 1; goto ret
+#define MPC_FAILURE(x) r->error = x; ok = 0; goto ret
 #define MPC_PRIMITIVE(x) \
   if (x) { MPC_SUCCESS(r->output); } \
   else { MPC_FAILURE(NULL); }
 
+/* How to free the items of a repeat whose fold mpc knows, or NULL */
+static mpc_dtor_t mpc_fold_dtor(mpc_fold_t f) {
+  if (f == mpcf_strfold) { return free; }
+  if (f == mpcf_fold_ast) { return (mpc_dtor_t)mpc_ast_delete; }
+  return NULL;
+}
+
 static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
 
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+  int k, ok = 0, top = 0, suppress;
+  long depth = 1;
+  mpc_dtor_t dx;
+  mpc_frame_chunk_t first, *chunk = &first, *next;
+  mpc_frame_t *f = &first.frames[0];
+  mpc_parser_t *call_p;
+  mpc_result_t *call_r;
+  mpc_err_t *overflow = NULL;
+
+  first.prev = NULL;
+  first.next = NULL;
+  f->p = p;
+  f->r = r;
+  f->stage = 0;
+
+  while (1) {
+
+  p = f->p;
+  r = f->r;
 
   switch (p->type) {
 
@@ -1072,21 +1177,24 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     /* Application Parsers */
 
     case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e)) {
+      if (f->stage == 0) { MPC_CALL(p->data.apply.x, r, 1); }
+      if (ok) {
         MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
       } else {
         MPC_FAILURE(r->output);
       }
 
     case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
+      if (f->stage == 0) { MPC_CALL(p->data.apply_to.x, r, 1); }
+      if (ok) {
         MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
       } else {
         MPC_FAILURE(r->error);
       }
 
     case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e)) {
+      if (f->stage == 0) { MPC_CALL(p->data.check.x, r, 1); }
+      if (ok) {
         if (p->data.check.f(&r->output)) {
           MPC_SUCCESS(r->output);
         } else {
@@ -1097,7 +1205,8 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       }
 
     case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e)) {
+      if (f->stage == 0) { MPC_CALL(p->data.check_with.x, r, 1); }
+      if (ok) {
         if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
           MPC_SUCCESS(r->output);
         } else {
@@ -1108,8 +1217,11 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       }
 
     case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e)) {
+      if (f->stage == 0) {
+        mpc_input_suppress_enable(i);
+        MPC_CALL(p->data.expect.x, r, 1);
+      }
+      if (ok) {
         mpc_input_suppress_disable(i);
         MPC_SUCCESS(r->output);
       } else {
@@ -1118,8 +1230,11 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       }
 
     case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e)) {
+      if (f->stage == 0) {
+        mpc_input_backtrack_disable(i);
+        MPC_CALL(p->data.predict.x, r, 1);
+      }
+      if (ok) {
         mpc_input_backtrack_enable(i);
         MPC_SUCCESS(r->output);
       } else {
@@ -1132,9 +1247,12 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     /* TODO: Update Not Error Message */
 
     case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
+      if (f->stage == 0) {
+        mpc_input_mark(i);
+        mpc_input_suppress_enable(i);
+        MPC_CALL(p->data.not.x, r, 1);
+      }
+      if (ok) {
         mpc_input_rewind(i);
         mpc_input_suppress_disable(i);
         mpc_parse_dtor(i, p->data.not.dx, r->output);
@@ -1142,13 +1260,16 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       } else {
         mpc_input_unmark(i);
         mpc_input_suppress_disable(i);
+        if (overflow) { MPC_FAILURE(r->error); }
         MPC_SUCCESS(p->data.not.lf());
       }
 
     case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
+      if (f->stage == 0) { MPC_CALL(p->data.not.x, r, 1); }
+      if (ok) {
         MPC_SUCCESS(r->output);
       } else {
+        if (overflow) { MPC_FAILURE(r->error); }
         *e = mpc_err_merge(i, *e, r->error);
         MPC_SUCCESS(p->data.not.lf());
       }
@@ -1156,125 +1277,157 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     /* Repeat Parsers */
 
     case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
 
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
+      if (f->stage == 0) {
+        f->results = f->results_stk;
+        f->slots = MPC_PARSE_STACK_MIN;
+        f->j = 0;
+        MPC_CALL(p->data.repeat.x, &f->results[0], 1);
       }
 
-      *e = mpc_err_merge(i, *e, results[j].error);
-
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-
-    case MPC_TYPE_MANY1:
-
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+      if (ok) {
+        f->j++;
+        if (f->j == MPC_PARSE_STACK_MIN) {
+          f->slots = f->j + f->j / 2;
+          f->results = mpc_malloc(i, sizeof(mpc_result_t) * f->slots);
+          memcpy(f->results, f->results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+        } else if (f->j >= f->slots) {
+          f->slots = f->j + f->j / 2;
+          f->results = mpc_realloc(i, f->results, sizeof(mpc_result_t) * f->slots);
         }
+        MPC_CALL(p->data.repeat.x, &f->results[f->j], 1);
       }
 
-      if (j == 0) {
+      dx = overflow ? mpc_fold_dtor(p->data.repeat.f) : NULL;
+      if (dx || (p->type == MPC_TYPE_MANY1 && f->j == 0)) {
+        for (k = 0; k < f->j; k++) {
+          mpc_parse_dtor(i, dx, f->results[k].output);
+        }
         MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+          mpc_err_many1(i, f->results[f->j].error);
+          if (f->j >= MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
+      }
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+      *e = mpc_err_merge(i, *e, f->results[f->j].error);
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+      MPC_SUCCESS(
+        mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)f->results);
+        if (f->j >= MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
 
     case MPC_TYPE_COUNT:
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+      if (f->stage == 0) {
+        f->results = p->data.repeat.n > MPC_PARSE_STACK_MIN
+          ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
+          : f->results_stk;
+        f->j = 0;
+        MPC_CALL(p->data.repeat.x, &f->results[0], 1);
+      }
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
+      if (ok) {
+        f->j++;
+        if (f->j != p->data.repeat.n) { MPC_CALL(p->data.repeat.x, &f->results[f->j], 1); }
       }
 
-      if (j == p->data.repeat.n) {
+      if (f->j == p->data.repeat.n) {
         MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+          mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)f->results);
+          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
       } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+        for (k = 0; k < f->j; k++) {
+          mpc_parse_dtor(i, p->data.repeat.dx, f->results[k].output);
         }
         MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+          mpc_err_count(i, f->results[f->j].error, p->data.repeat.n);
+          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
       }
 
     /* Combinatory Parsers */
 
     case MPC_TYPE_OR:
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+      /*
+      ** With a prediction table only the alternatives which
+      ** can start with the next character are tried (stage 1).
+      ** The rest cannot succeed, so they are only run once
+      ** everything else has failed, to collect what they
+      ** expected (stage 2).
+      */
+
+      if (f->stage == 0) {
+        if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+        f->results = p->data.or.n > MPC_PARSE_STACK_MIN
+          ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+          : f->results_stk;
+        f->predict = p->data.or.predict
+          ? p->data.or.predict[(unsigned char)mpc_input_peekc(i)] : 0;
+        f->stage = p->data.or.predict ? 1 : 2;
+        f->j = -1;
+        ok = 0;
+      } else if (ok) {
+        if (f->stage == 1) {
+          for (k = 0; k < f->j; k++) {
+            if (f->predict & (1UL << k)) { *e = mpc_err_merge(i, *e, f->results[k].error); }
+          }
+        } else if (p->data.or.predict) {
+          /* Predicted alternatives past this one were not merged yet */
+          for (k = f->j + 1; k < p->data.or.n; k++) {
+            if (f->predict & (1UL << k)) { mpc_err_delete_internal(i, f->results[k].error); }
+          }
+        }
+        MPC_SUCCESS(f->results[f->j].output;
+          if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
+      } else if (f->stage == 2) {
+        *e = mpc_err_merge(i, *e, f->results[f->j].error);
+      }
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      if (f->stage == 1) {
+        for (f->j++; f->j < p->data.or.n; f->j++) {
+          if (f->predict & (1UL << f->j)) { MPC_CALL(p->data.or.xs[f->j], &f->results[f->j], 1); }
+        }
+        f->stage = 2;
+        f->j = -1;
+      }
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
+      for (f->j++; f->j < p->data.or.n; f->j++) {
+        if (!p->data.or.predict || !(f->predict & (1UL << f->j))) {
+          MPC_CALL(p->data.or.xs[f->j], &f->results[f->j], 2);
         }
+        *e = mpc_err_merge(i, *e, f->results[f->j].error);
       }
 
       MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
 
     case MPC_TYPE_AND:
 
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
-
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      if (f->stage == 0) {
+        if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+        f->results = p->data.and.n > MPC_PARSE_STACK_MIN
+          ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.and.n)
+          : f->results_stk;
+        mpc_input_mark(i);
+        f->j = 0;
+        MPC_CALL(p->data.and.xs[0], &f->results[0], 1);
+      }
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      if (!ok) {
+        mpc_input_rewind(i);
+        for (k = 0; k < f->j; k++) {
+          mpc_parse_dtor(i, p->data.and.dxs[k], f->results[k].output);
         }
+        MPC_FAILURE(f->results[f->j].error;
+          if (p->data.and.n > MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
       }
+
+      f->j++;
+      if (f->j < p->data.and.n) { MPC_CALL(p->data.and.xs[f->j], &f->results[f->j], 1); }
+
       mpc_input_unmark(i);
       MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        mpc_parse_fold(i, p->data.and.f, f->j, (mpc_val_t**)f->results);
+        if (p->data.and.n > MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
 
     /* End */
 
@@ -1283,18 +1436,95 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
   }
 
-  return 0;
+  /*
+  ** Once the depth limit is hit every child fails straight
+  ** away, so the frames unwind through their usual failure
+  ** paths and free what they hold. Those which would turn a
+  ** failure into success fail too: maybe and not, and many
+  ** when it knows how to free its items. A many with a fold
+  ** of the user's succeeds as usual, for a parent which has
+  ** a destructor for it to free.
+  */
+
+  call:
+    if (overflow || (mpc_parse_depth_max > 0 && depth >= mpc_parse_depth_max)) {
+      if (!overflow) {
+        suppress = i->suppress;
+        i->suppress = 0;
+        overflow = mpc_err_fail(i, "Maximum parse depth exceeded!");
+        i->suppress = suppress;
+      }
+      call_r->error = NULL;
+      ok = 0;
+      continue;
+    }
+
+    if (++top == MPC_PARSE_CHUNK) {
+      if (chunk->next == NULL) {
+        chunk->next = malloc(sizeof(mpc_frame_chunk_t));
+        chunk->next->prev = chunk;
+        chunk->next->next = NULL;
+      }
+      chunk = chunk->next;
+      top = 0;
+    }
+
+    depth++;
+    f = &chunk->frames[top];
+    f->p = call_p;
+    f->r = call_r;
+    f->stage = 0;
+    continue;
+
+  ret:
+    if (--depth == 0) { break; }
+
+    if (top-- == 0) {
+      chunk = chunk->prev;
+      top = MPC_PARSE_CHUNK-1;
+    }
+
+    f = &chunk->frames[top];
+  }
+
+  chunk = first.next;
+  while (chunk) {
+    next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+
+  /*
+  ** Report the depth, not whatever failed while unwinding. A
+  ** root can only succeed here through a many with a fold of
+  ** the user's, whose output there's no way to free, except
+  ** an AST in the arena, which goes with it.
+  */
+  if (overflow) {
+    if (ok) { r->output = NULL; } else { mpc_err_delete_internal(i, r->error); }
+    mpc_err_delete_internal(i, *e);
+    *e = NULL;
+    r->error = overflow;
+    return 0;
+  }
+
+  return ok;
 
 }
 
+#undef MPC_CALL
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
 
+static mpc_ast_arena_t *mpc_ast_arena_new(void);
+static void mpc_ast_arena_own(mpc_ast_arena_t *m, mpc_ast_t *a);
+
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
+  if (p->pooled) { i->arena = mpc_ast_arena_new(); }
   x = mpc_parse_run(i, p, r, &e);
   if (x) {
     mpc_err_delete_internal(i, e);
@@ -1302,6 +1532,10 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   } else {
     r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
   }
+  if (i->arena) {
+    mpc_ast_arena_own(i->arena, x ? r->output : NULL);
+    i->arena = NULL;
+  }
   return x;
 }
 
@@ -1366,6 +1600,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.predict);
 
 }
 
@@ -1528,6 +1763,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      if (a->data.or.predict) {
+        p->data.or.predict = malloc(sizeof(unsigned long) * 256);
+        memcpy(p->data.or.predict, a->data.or.predict, sizeof(unsigned long) * 256);
+      }
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -1569,6 +1808,7 @@ mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   if (p->retained) {
     p->type = a->type;
     p->data = a->data;
+    p->pooled = 0;
   } else {
     mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
     p->type = a2->type;
@@ -1920,6 +2160,7 @@ mpc_parser_t *mpc_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.predict = NULL;
 
   va_start(va, n);
   for (i = 0; i < n; i++) {
@@ -2869,12 +3110,109 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+static mpc_ast_arena_t *mpc_ast_arena_new(void) {
+  mpc_ast_arena_t *m = malloc(sizeof(mpc_ast_arena_t));
+  m->block = NULL;
+  m->root = NULL;
+  m->foreign = 0;
+  return m;
+}
+
+static void *mpc_ast_arena_alloc(mpc_ast_arena_t *m, size_t n) {
+
+  size_t size;
+  mpc_ast_block_t *b = m->block;
+
+  n = MPC_AST_ALIGN(n);
+
+  if (b == NULL || b->size - b->used < n) {
+    size = b ? b->size * 2 : MPC_AST_BLOCK_MIN;
+    if (size > MPC_AST_BLOCK_MAX) { size = MPC_AST_BLOCK_MAX; }
+    if (size < n) { size = n; }
+    b = malloc(MPC_AST_ALIGN(sizeof(mpc_ast_block_t)) + size);
+    b->next = m->block;
+    b->used = 0;
+    b->size = size;
+    m->block = b;
+  }
+
+  b->used += n;
+  return (char*)b + MPC_AST_ALIGN(sizeof(mpc_ast_block_t)) + b->used - n;
+}
+
+static char *mpc_ast_arena_strdup(mpc_ast_arena_t *m, const char *s) {
+  size_t l = strlen(s) + 1;
+  char *x = mpc_ast_arena_alloc(m, l);
+  memcpy(x, s, l);
+  return x;
+}
+
+static mpc_ast_t *mpc_ast_arena_node(mpc_ast_arena_t *m, const char *tag, const char *contents) {
+
+  size_t tl = strlen(tag) + 1;
+  size_t cl = strlen(contents) + 1;
+
+  /* Node and strings share one allocation */
+  mpc_ast_t *a = mpc_ast_arena_alloc(m, MPC_AST_ALIGN(sizeof(mpc_ast_t)) + tl + cl);
+  a->tag = (char*)a + MPC_AST_ALIGN(sizeof(mpc_ast_t));
+  a->contents = a->tag + tl;
+  memcpy(a->tag, tag, tl);
+  memcpy(a->contents, contents, cl);
+
+  a->state = mpc_state_new();
+  a->rule = 0;
+  a->children_num = 0;
+  a->children_max = 0;
+  a->children = NULL;
+  a->arena = m;
+  return a;
+}
+
+static void mpc_ast_arena_delete_foreign(mpc_ast_arena_t *m, mpc_ast_t *a) {
+  int i;
+  for (i = 0; i < a->children_num; i++) {
+    if (a->children[i] && a->children[i]->arena == m) {
+      mpc_ast_arena_delete_foreign(m, a->children[i]);
+    } else {
+      mpc_ast_delete(a->children[i]);
+    }
+  }
+}
+
+static void mpc_ast_arena_delete(mpc_ast_arena_t *m) {
+
+  mpc_ast_block_t *b;
+
+  /* Nodes from elsewhere added into the tree are owned by it too */
+  if (m->foreign && m->root) { mpc_ast_arena_delete_foreign(m, m->root); }
+
+  while (m->block) {
+    b = m->block;
+    m->block = b->next;
+    free(b);
+  }
+  free(m);
+}
+
+static void mpc_ast_arena_own(mpc_ast_arena_t *m, mpc_ast_t *a) {
+  if (a && a->arena == m) {
+    m->root = a;
+  } else {
+    mpc_ast_arena_delete(m);
+  }
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
 
   int i;
 
   if (a == NULL) { return; }
 
+  if (a->arena) {
+    if (a->arena->root == a) { mpc_ast_arena_delete(a->arena); }
+    return;
+  }
+
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
   }
@@ -2887,6 +3225,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (a->arena) { return; }
   free(a->children);
   free(a->tag);
   free(a->contents);
@@ -2904,9 +3243,12 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   strcpy(a->contents, contents);
 
   a->state = mpc_state_new();
+  a->rule = 0;
 
   a->children_num = 0;
+  a->children_max = 0;
   a->children = NULL;
+  a->arena = NULL;
   return a;
 
 }
@@ -2937,7 +3279,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = a->arena ? mpc_ast_arena_node(a->arena, ">", "") : mpc_ast_new(">", "");
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2947,6 +3289,7 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   int i;
 
   if (strcmp(a->tag, b->tag) != 0) { return 0; }
+  if (a->rule != b->rule) { return 0; }
   if (strcmp(a->contents, b->contents) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
 
@@ -2958,14 +3301,40 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+
+  mpc_ast_t **children;
+
+  if (r->arena) {
+    if (a && a->arena != r->arena) { r->arena->foreign++; }
+    /* Arena memory is never given back, so double rather than copy every time */
+    if (r->children_num == r->children_max) {
+      r->children_max = r->children_max ? r->children_max * 2 : 4;
+      children = mpc_ast_arena_alloc(r->arena, sizeof(mpc_ast_t*) * r->children_max);
+      if (r->children_num) { memcpy(children, r->children, sizeof(mpc_ast_t*) * r->children_num); }
+      r->children = children;
+    }
+    r->children[r->children_num++] = a;
+    return r;
+  }
+
   r->children_num++;
+  r->children_max = r->children_num;
   r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
   return r;
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+  char *tag;
   if (a == NULL) { return a; }
+  if (a->arena) {
+    tag = mpc_ast_arena_alloc(a->arena, strlen(t) + 1 + strlen(a->tag) + 1);
+    strcpy(tag, t);
+    strcat(tag, "|");
+    strcat(tag, a->tag);
+    a->tag = tag;
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -2974,7 +3343,17 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
+  char *tag;
   if (a == NULL) { return a; }
+  /* Adding the root's own ">" changes nothing */
+  if (strlen(t) <= 1) { return a; }
+  if (a->arena) {
+    tag = mpc_ast_arena_alloc(a->arena, (strlen(t)-1) + strlen(a->tag) + 1);
+    memcpy(tag, t, strlen(t)-1);
+    strcpy(tag + (strlen(t)-1), a->tag);
+    a->tag = tag;
+    return a;
+  }
   a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
@@ -2982,6 +3361,10 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  if (a->arena) {
+    a->tag = mpc_ast_arena_strdup(a->arena, t);
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -3195,9 +3578,9 @@ void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
   }
 }
 
-mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+static mpc_val_t *mpc_ast_fold(mpc_ast_arena_t *m, int n, mpc_val_t **xs) {
 
-  int i, j;
+  int i, j, k;
   mpc_ast_t** as = (mpc_ast_t**)xs;
   mpc_ast_t *r;
 
@@ -3206,20 +3589,37 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   if (n == 2 && xs[1] == NULL) { return xs[0]; }
   if (n == 2 && xs[0] == NULL) { return xs[1]; }
 
-  r = mpc_ast_new(">", "");
+  /* Size the children once */
+  k = 0;
+  for (i = 0; i < n; i++) {
+    if (as[i] == NULL) { continue; }
+    k += as[i]->children_num >= 2 ? as[i]->children_num : 1;
+  }
+
+  if (m) {
+    r = mpc_ast_arena_node(m, ">", "");
+    r->children = mpc_ast_arena_alloc(m, sizeof(mpc_ast_t*) * k);
+  } else {
+    r = mpc_ast_new(">", "");
+    r->children = k ? malloc(sizeof(mpc_ast_t*) * k) : NULL;
+  }
+  r->children_max = k;
 
   for (i = 0; i < n; i++) {
 
     if (as[i] == NULL) { continue; }
 
-    if        (as[i] && as[i]->children_num == 0) {
-      mpc_ast_add_child(r, as[i]);
-    } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+    if (as[i]->arena != m && m) { m->foreign++; }
+
+    if        (as[i]->children_num == 0) {
+      r->children[r->children_num++] = as[i];
+    } else if (as[i]->children_num == 1) {
+      if (as[i]->children[0]->rule == 0) { as[i]->children[0]->rule = as[i]->rule; }
+      r->children[r->children_num++] = mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag);
       mpc_ast_delete_no_children(as[i]);
-    } else if (as[i] && as[i]->children_num >= 2) {
+    } else {
       for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
+        r->children[r->children_num++] = as[i]->children[j];
       }
       mpc_ast_delete_no_children(as[i]);
     }
@@ -3233,6 +3633,10 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   return r;
 }
 
+mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+  return mpc_ast_fold(NULL, n, xs);
+}
+
 mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
   mpc_ast_t *a = mpc_ast_new("", c);
   free(c);
@@ -3264,6 +3668,16 @@ mpc_parser_t *mpca_root(mpc_parser_t *a) {
   return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
 }
 
+static mpc_val_t *mpcf_ast_rule(mpc_val_t *x, void *r) {
+  mpc_ast_t *a = x;
+  if (a != NULL && a->rule == 0) { a->rule = ((mpc_parser_t*)r)->rule; }
+  return a;
+}
+
+mpc_parser_t *mpca_rule(mpc_parser_t *a, mpc_parser_t *r) {
+  return mpc_apply_to(a, mpcf_ast_rule, r);
+}
+
 mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
 mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
 mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
@@ -3280,6 +3694,7 @@ mpc_parser_t *mpca_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.predict = NULL;
 
   va_start(va, n);
   for (i = 0; i < n; i++) {
@@ -3459,6 +3874,7 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
       if (st->parsers[st->parsers_num-1] == NULL) {
         return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
       }
+      if (st->flags & MPCA_LANG_RULE_IDS) { st->parsers[st->parsers_num-1]->rule = st->parsers_num; }
     }
 
     return st->parsers[st->parsers_num-1];
@@ -3483,6 +3899,7 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
       st->parsers[st->parsers_num-1] = p;
 
       if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      if (st->flags & MPCA_LANG_RULE_IDS) { p->rule = st->parsers_num; }
       if (p->name && strcmp(p->name, x) == 0) { return p; }
 
     }
@@ -3497,7 +3914,9 @@ static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   mpc_parser_t *p = mpca_grammar_find_parser(x, st);
   free(x);
 
-  if (p->name) {
+  if (st->flags & MPCA_LANG_RULE_IDS) {
+    return mpca_state(mpca_root(mpca_rule(p, p)));
+  } else if (p->name) {
     return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
   } else {
     return mpca_state(mpca_root(p));
@@ -3637,24 +4056,42 @@ static void mpca_stmt_list_delete(mpc_val_t *x) {
 
 static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
 
+  int i, j, n, pooled;
   mpca_grammar_st_t *st = s;
   mpca_stmt_t *stmt;
   mpca_stmt_t **stmts = x;
-  mpc_parser_t *left;
+  mpc_parser_t **lefts;
 
-  while(*stmts) {
-    stmt = *stmts;
-    left = mpca_grammar_find_parser(stmt->ident, st);
+  for (n = 0; stmts[n]; n++);
+  lefts = malloc(sizeof(mpc_parser_t*) * (n+1));
+
+  for (i = 0; i < n; i++) {
+    stmt = stmts[i];
+    lefts[i] = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
-    mpc_define(left, stmt->grammar);
+    mpc_define(lefts[i], stmt->grammar);
     free(stmt->ident);
     free(stmt->name);
     free(stmt);
-    stmts++;
   }
 
+  /* Now every rule is defined rebuild the prediction tables */
+  for (i = 0; i < n; i++) { mpc_optimise(lefts[i]); }
+
+  /*
+  ** Only pool ASTs when every rule involved was defined
+  ** here, as then nothing but this file touches the nodes.
+  */
+  pooled = 1;
+  for (i = 0; i < st->parsers_num; i++) {
+    for (j = 0; j < n; j++) { if (st->parsers[i] == lefts[j]) { break; } }
+    if (j == n) { pooled = 0; }
+  }
+  for (i = 0; i < n; i++) { lefts[i]->pooled = pooled; }
+
+  free(lefts);
   free(x);
 
   return NULL;
@@ -3830,32 +4267,33 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   return err;
 }
 
-static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
+static int mpc_nodecount_unretained(mpc_parser_t* p, int force, int *predictive) {
 
   int i, total;
 
   if (p->retained && !force) { return 0; }
 
-  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
+  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0, predictive); }
 
-  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0, predictive); }
+  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0, predictive); }
+  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0, predictive); }
 
-  if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
-  if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
+  if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0, predictive); }
+  if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0, predictive); }
 
-  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0, predictive); }
+  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0, predictive); }
 
-  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0, predictive); }
+  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0, predictive); }
+  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0, predictive); }
 
   if (p->type == MPC_TYPE_OR) {
     total = 1;
+    if (p->data.or.predict) { (*predictive)++; }
     for(i = 0; i < p->data.or.n; i++) {
-      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
+      total += mpc_nodecount_unretained(p->data.or.xs[i], 0, predictive);
     }
     return total;
   }
@@ -3863,7 +4301,7 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_AND) {
     total = 1;
     for(i = 0; i < p->data.and.n; i++) {
-      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
+      total += mpc_nodecount_unretained(p->data.and.xs[i], 0, predictive);
     }
     return total;
   }
@@ -3873,17 +4311,173 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
 }
 
 void mpc_stats(mpc_parser_t* p) {
+  int predictive = 0;
+  int total = mpc_nodecount_unretained(p, 1, &predictive);
   printf("Stats\n");
   printf("=====\n");
-  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  printf("Node Count: %i\n", total);
+  printf("Predictive Nodes: %i\n", predictive);
 }
 
-static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
+/*
+** First Sets
+*/
 
-  int i, n, m;
-  mpc_parser_t *t;
+/*
+** To avoid trying every alternative of an `or`
+** in turn we work out which characters each
+** alternative can possibly start with. From
+** this we build a table indexed by the next
+** character of input giving a bitmask of the
+** alternatives worth trying.
+**
+** `mpc_first` adds the characters `p` can start
+** with to `set` and returns non-zero if `p` can
+** succeed without consuming anything, or if we
+** cannot tell what it will do. In both cases
+** the alternative must be tried on any input.
+**
+** Tables are computed for the grammar as it
+** stands when `mpc_optimise` is called, so it
+** should be called again if rules are later
+** redefined. `mpca_lang` does this itself once
+** every rule in the language is defined.
+*/
 
-  if (p->retained && !force) { return; }
+enum {
+  MPC_FIRST_DEPTH_MAX = 64
+};
+
+static int mpc_first_any(char *set) {
+  int c;
+  for (c = 1; c < 256; c++) { set[c] = 1; }
+  return 1;
+}
+
+static int mpc_first(mpc_parser_t *p, char *set, int depth) {
+
+  int j, c;
+  const char *s;
+
+  if (depth > MPC_FIRST_DEPTH_MAX) { return mpc_first_any(set); }
+
+  switch (p->type) {
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SATISFY:
+      mpc_first_any(set);
+      return 0;
+
+    case MPC_TYPE_SINGLE:
+      set[(unsigned char)p->data.single.x] = 1;
+      return 0;
+
+    case MPC_TYPE_RANGE:
+      for (c = 1; c < 256; c++) {
+        if ((char)c >= p->data.range.x && (char)c <= p->data.range.y) { set[c] = 1; }
+      }
+      return 0;
+
+    case MPC_TYPE_ONEOF:
+      for (s = p->data.string.x; *s; s++) { set[(unsigned char)*s] = 1; }
+      return 0;
+
+    case MPC_TYPE_NONEOF:
+      for (c = 1; c < 256; c++) {
+        if (!strchr(p->data.string.x, (char)c)) { set[c] = 1; }
+      }
+      return 0;
+
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { return 1; }
+      set[(unsigned char)p->data.string.x[0]] = 1;
+      return 0;
+
+    case MPC_TYPE_FAIL: return 0;
+
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_NOT:
+      return 1;
+
+    case MPC_TYPE_EXPECT:     return mpc_first(p->data.expect.x, set, depth+1);
+    case MPC_TYPE_APPLY:      return mpc_first(p->data.apply.x, set, depth+1);
+    case MPC_TYPE_APPLY_TO:   return mpc_first(p->data.apply_to.x, set, depth+1);
+    case MPC_TYPE_CHECK:      return mpc_first(p->data.check.x, set, depth+1);
+    case MPC_TYPE_CHECK_WITH: return mpc_first(p->data.check_with.x, set, depth+1);
+    case MPC_TYPE_PREDICT:    return mpc_first(p->data.predict.x, set, depth+1);
+
+    case MPC_TYPE_MAYBE: mpc_first(p->data.not.x, set, depth+1); return 1;
+    case MPC_TYPE_MANY:  mpc_first(p->data.repeat.x, set, depth+1); return 1;
+    case MPC_TYPE_MANY1: return mpc_first(p->data.repeat.x, set, depth+1);
+
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n <= 0) { return mpc_first_any(set); }
+      return mpc_first(p->data.repeat.x, set, depth+1);
+
+    case MPC_TYPE_OR:
+      c = 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        if (mpc_first(p->data.or.xs[j], set, depth+1)) { c = 1; }
+      }
+      return c;
+
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_first(p->data.and.xs[j], set, depth+1)) { return 0; }
+      }
+      return 1;
+
+    default: return mpc_first_any(set);
+  }
+
+}
+
+static void mpc_optimise_predict(mpc_parser_t *p) {
+
+  int j, c;
+  char set[256];
+  unsigned long all = 0;
+  unsigned long *table;
+
+  free(p->data.or.predict);
+  p->data.or.predict = NULL;
+
+  if (p->data.or.n < 2 || p->data.or.n > MPC_PREDICT_MAX) { return; }
+
+  table = calloc(256, sizeof(unsigned long));
+
+  for (j = 0; j < p->data.or.n; j++) {
+    memset(set, 0, sizeof(set));
+    if (mpc_first(p->data.or.xs[j], set, 0)) { memset(set, 1, sizeof(set)); }
+    for (c = 0; c < 256; c++) {
+      if (set[c]) { table[c] |= 1UL << j; }
+    }
+    all |= 1UL << j;
+  }
+
+  /* Not worth a lookup if it never rules anything out */
+  for (c = 0; c < 256; c++) {
+    if (table[c] != all) {
+      p->data.or.predict = table;
+      return;
+    }
+  }
+
+  free(table);
+}
+
+static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
+
+  int i, n, m;
+  mpc_parser_t *t;
+
+  if (p->retained && !force) { return; }
 
   /* Optimise Subexpressions */
 
@@ -3924,7 +4518,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.predict); free(t->name); free(t);
       continue;
     }
 
@@ -3938,7 +4532,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.predict); free(t->name); free(t);
       continue;
     }
 
@@ -4041,6 +4635,9 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
 
+    /* Build `or` prediction table */
+    if (p->type == MPC_TYPE_OR) { mpc_optimise_predict(p); }
+
     return;
 
   }
@@ -4051,3 +4648,594 @@ void mpc_optimise(mpc_parser_t *p) {
   mpc_optimise_unretained(p, 1);
 }
 
+
+/*
+** Saving and Loading
+*/
+
+/*
+** A set of retained parsers can be written out as
+** a flat binary image and read back later without
+** running the grammar compiler again.
+**
+** Nodes are written in pre-order. References to
+** other parsers in the set are written as their
+** index, and functions as their position in the
+** table below, so only grammars built from the
+** functions in this file (which includes anything
+** made by `mpca_lang`) can be saved.
+*/
+
+#define MPC_IMAGE_MAGIC "mpcI"
+#define MPC_IMAGE_NONE 0xFFFFFFFFUL
+
+enum {
+  MPC_IMAGE_VERSION = 3,
+  MPC_IMAGE_REF     = 0xFF
+};
+
+enum {
+  MPC_IMAGE_DATA_NULL   = 0,
+  MPC_IMAGE_DATA_NAME   = 1,
+  MPC_IMAGE_DATA_TAG    = 2,
+  MPC_IMAGE_DATA_PARSER = 3
+};
+
+typedef void (*mpc_image_fn_t)(void);
+
+static const mpc_image_fn_t mpc_image_fns[] = {
+  NULL,
+  (mpc_image_fn_t)free,
+  (mpc_image_fn_t)mpcf_dtor_null,
+  (mpc_image_fn_t)mpcf_ctor_null,
+  (mpc_image_fn_t)mpcf_ctor_str,
+  (mpc_image_fn_t)mpcf_free,
+  (mpc_image_fn_t)mpcf_int,
+  (mpc_image_fn_t)mpcf_hex,
+  (mpc_image_fn_t)mpcf_oct,
+  (mpc_image_fn_t)mpcf_float,
+  (mpc_image_fn_t)mpcf_strtriml,
+  (mpc_image_fn_t)mpcf_strtrimr,
+  (mpc_image_fn_t)mpcf_strtrim,
+  (mpc_image_fn_t)mpcf_escape,
+  (mpc_image_fn_t)mpcf_escape_regex,
+  (mpc_image_fn_t)mpcf_escape_string_raw,
+  (mpc_image_fn_t)mpcf_escape_char_raw,
+  (mpc_image_fn_t)mpcf_unescape,
+  (mpc_image_fn_t)mpcf_unescape_regex,
+  (mpc_image_fn_t)mpcf_unescape_string_raw,
+  (mpc_image_fn_t)mpcf_unescape_char_raw,
+  (mpc_image_fn_t)mpcf_null,
+  (mpc_image_fn_t)mpcf_fst,
+  (mpc_image_fn_t)mpcf_snd,
+  (mpc_image_fn_t)mpcf_trd,
+  (mpc_image_fn_t)mpcf_fst_free,
+  (mpc_image_fn_t)mpcf_snd_free,
+  (mpc_image_fn_t)mpcf_trd_free,
+  (mpc_image_fn_t)mpcf_freefold,
+  (mpc_image_fn_t)mpcf_strfold,
+  (mpc_image_fn_t)mpcf_maths,
+  (mpc_image_fn_t)mpc_boundary_anchor,
+  (mpc_image_fn_t)mpc_boundary_newline_anchor,
+  (mpc_image_fn_t)mpc_ast_delete,
+  (mpc_image_fn_t)mpc_ast_add_root,
+  (mpc_image_fn_t)mpc_ast_tag,
+  (mpc_image_fn_t)mpc_ast_add_tag,
+  (mpc_image_fn_t)mpcf_fold_ast,
+  (mpc_image_fn_t)mpcf_str_ast,
+  (mpc_image_fn_t)mpcf_state_ast,
+  (mpc_image_fn_t)mpcf_ast_rule
+};
+
+/* Tags `mpca_lang` gives to literals */
+static const char *mpc_image_tags[] = { "string", "char", "regex" };
+
+typedef struct {
+  FILE *f;
+  int n;
+  mpc_parser_t **ps;
+} mpc_image_writer_t;
+
+typedef struct {
+  const unsigned char *data;
+  size_t length;
+  size_t pos;
+  int n;
+  mpc_parser_t **ps;
+} mpc_image_reader_t;
+
+static int mpc_image_put_u8(mpc_image_writer_t *w, unsigned int x) {
+  return fputc((int)(x & 0xFF), w->f) != EOF;
+}
+
+static int mpc_image_put_u32(mpc_image_writer_t *w, unsigned long x) {
+  return mpc_image_put_u8(w, (unsigned int)(x >>  0))
+      && mpc_image_put_u8(w, (unsigned int)(x >>  8))
+      && mpc_image_put_u8(w, (unsigned int)(x >> 16))
+      && mpc_image_put_u8(w, (unsigned int)(x >> 24));
+}
+
+static int mpc_image_put_str(mpc_image_writer_t *w, const char *s) {
+  size_t l;
+  if (s == NULL) { return mpc_image_put_u32(w, MPC_IMAGE_NONE); }
+  l = strlen(s);
+  return mpc_image_put_u32(w, (unsigned long)l) && fwrite(s, 1, l, w->f) == l;
+}
+
+static int mpc_image_put_fn(mpc_image_writer_t *w, mpc_image_fn_t f) {
+  unsigned int i;
+  for (i = 0; i < sizeof(mpc_image_fns) / sizeof(mpc_image_fn_t); i++) {
+    if (mpc_image_fns[i] == f) { return mpc_image_put_u8(w, i); }
+  }
+  return 0;
+}
+
+static int mpc_image_index(mpc_image_writer_t *w, mpc_parser_t *p) {
+  int i;
+  for (i = 0; i < w->n; i++) {
+    if (w->ps[i] == p) { return i; }
+  }
+  return -1;
+}
+
+static int mpc_image_put_data(mpc_image_writer_t *w, void *d) {
+
+  int i;
+
+  if (d == NULL) { return mpc_image_put_u8(w, MPC_IMAGE_DATA_NULL); }
+
+  /* `mpca_add_tag` points at the rule's name and `mpca_rule` at the rule */
+  for (i = 0; i < w->n; i++) {
+    if (w->ps[i]->name == d) {
+      return mpc_image_put_u8(w, MPC_IMAGE_DATA_NAME) && mpc_image_put_u32(w, i);
+    }
+    if (w->ps[i] == d) {
+      return mpc_image_put_u8(w, MPC_IMAGE_DATA_PARSER) && mpc_image_put_u32(w, i);
+    }
+  }
+
+  for (i = 0; i < (int)(sizeof(mpc_image_tags) / sizeof(char*)); i++) {
+    if (strcmp(mpc_image_tags[i], (const char*)d) == 0) {
+      return mpc_image_put_u8(w, MPC_IMAGE_DATA_TAG) && mpc_image_put_u8(w, i);
+    }
+  }
+
+  return 0;
+}
+
+static int mpc_image_put(mpc_image_writer_t *w, mpc_parser_t *p, int force) {
+
+  int i;
+
+  if (p->retained && !force) {
+    i = mpc_image_index(w, p);
+    return i >= 0 && mpc_image_put_u8(w, MPC_IMAGE_REF) && mpc_image_put_u32(w, i);
+  }
+
+  if (!mpc_image_put_u8(w, (unsigned char)p->type)) { return 0; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+      return 1;
+
+    case MPC_TYPE_FAIL: return mpc_image_put_str(w, p->data.fail.m);
+    case MPC_TYPE_LIFT: return mpc_image_put_fn(w, (mpc_image_fn_t)p->data.lift.lf);
+
+    /* Arbitrary values can't be written out */
+    case MPC_TYPE_LIFT_VAL: return p->data.lift.x == NULL;
+
+    case MPC_TYPE_EXPECT:
+      return mpc_image_put_str(w, p->data.expect.m)
+          && mpc_image_put(w, p->data.expect.x, 0);
+
+    case MPC_TYPE_ANCHOR: return mpc_image_put_fn(w, (mpc_image_fn_t)p->data.anchor.f);
+    case MPC_TYPE_SATISFY: return mpc_image_put_fn(w, (mpc_image_fn_t)p->data.satisfy.f);
+
+    case MPC_TYPE_SINGLE: return mpc_image_put_u8(w, (unsigned char)p->data.single.x);
+    case MPC_TYPE_RANGE:
+      return mpc_image_put_u8(w, (unsigned char)p->data.range.x)
+          && mpc_image_put_u8(w, (unsigned char)p->data.range.y);
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      return mpc_image_put_str(w, p->data.string.x);
+
+    case MPC_TYPE_APPLY:
+      return mpc_image_put_fn(w, (mpc_image_fn_t)p->data.apply.f)
+          && mpc_image_put(w, p->data.apply.x, 0);
+
+    case MPC_TYPE_APPLY_TO:
+      return mpc_image_put_fn(w, (mpc_image_fn_t)p->data.apply_to.f)
+          && mpc_image_put_data(w, p->data.apply_to.d)
+          && mpc_image_put(w, p->data.apply_to.x, 0);
+
+    case MPC_TYPE_PREDICT: return mpc_image_put(w, p->data.predict.x, 0);
+
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      return mpc_image_put_fn(w, (mpc_image_fn_t)p->data.not.dx)
+          && mpc_image_put_fn(w, (mpc_image_fn_t)p->data.not.lf)
+          && mpc_image_put(w, p->data.not.x, 0);
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      return mpc_image_put_u32(w, (unsigned long)p->data.repeat.n)
+          && mpc_image_put_fn(w, (mpc_image_fn_t)p->data.repeat.f)
+          && mpc_image_put_fn(w, (mpc_image_fn_t)p->data.repeat.dx)
+          && mpc_image_put(w, p->data.repeat.x, 0);
+
+    case MPC_TYPE_OR:
+      if (!mpc_image_put_u32(w, p->data.or.n)) { return 0; }
+      for (i = 0; i < p->data.or.n; i++) {
+        if (!mpc_image_put(w, p->data.or.xs[i], 0)) { return 0; }
+      }
+      return 1;
+
+    case MPC_TYPE_AND:
+      if (!mpc_image_put_u32(w, p->data.and.n)) { return 0; }
+      if (!mpc_image_put_fn(w, (mpc_image_fn_t)p->data.and.f)) { return 0; }
+      for (i = 0; i < p->data.and.n-1; i++) {
+        if (!mpc_image_put_fn(w, (mpc_image_fn_t)p->data.and.dxs[i])) { return 0; }
+      }
+      for (i = 0; i < p->data.and.n; i++) {
+        if (!mpc_image_put(w, p->data.and.xs[i], 0)) { return 0; }
+      }
+      return 1;
+
+    /* User functions and data can't be written out */
+    default: return 0;
+  }
+
+}
+
+int mpc_save(FILE *f, int n, ...) {
+
+  int i, ok;
+  mpc_image_writer_t w;
+  va_list va;
+
+  w.f = f;
+  w.n = n;
+  w.ps = malloc(sizeof(mpc_parser_t*) * n);
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) { w.ps[i] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
+
+  ok = fwrite(MPC_IMAGE_MAGIC, 1, 4, f) == 4
+    && mpc_image_put_u8(&w, MPC_IMAGE_VERSION)
+    && mpc_image_put_u32(&w, n);
+
+  for (i = 0; ok && i < n; i++) {
+    ok = w.ps[i]->retained
+      && mpc_image_put_str(&w, w.ps[i]->name)
+      && mpc_image_put_u32(&w, (unsigned long)w.ps[i]->rule)
+      && mpc_image_put_u8(&w, (unsigned char)w.ps[i]->pooled);
+  }
+
+  for (i = 0; ok && i < n; i++) {
+    ok = mpc_image_put(&w, w.ps[i], 1);
+  }
+
+  free(w.ps);
+  return ok;
+}
+
+static int mpc_image_get_u8(mpc_image_reader_t *r, unsigned int *x) {
+  if (r->pos >= r->length) { return 0; }
+  *x = r->data[r->pos++];
+  return 1;
+}
+
+static int mpc_image_get_u32(mpc_image_reader_t *r, unsigned long *x) {
+  if (r->length - r->pos < 4) { return 0; }
+  *x = ((unsigned long)r->data[r->pos+0] <<  0)
+     | ((unsigned long)r->data[r->pos+1] <<  8)
+     | ((unsigned long)r->data[r->pos+2] << 16)
+     | ((unsigned long)r->data[r->pos+3] << 24);
+  r->pos += 4;
+  return 1;
+}
+
+static int mpc_image_get_str(mpc_image_reader_t *r, char **s) {
+  unsigned long l;
+  *s = NULL;
+  if (!mpc_image_get_u32(r, &l)) { return 0; }
+  if (l == MPC_IMAGE_NONE) { return 1; }
+  if (l > r->length - r->pos) { return 0; }
+  *s = malloc(l + 1);
+  memcpy(*s, r->data + r->pos, l);
+  (*s)[l] = '\0';
+  r->pos += l;
+  return 1;
+}
+
+static int mpc_image_get_fn(mpc_image_reader_t *r, mpc_image_fn_t *f) {
+  unsigned int i;
+  if (!mpc_image_get_u8(r, &i)) { return 0; }
+  if (i >= sizeof(mpc_image_fns) / sizeof(mpc_image_fn_t)) { return 0; }
+  *f = mpc_image_fns[i];
+  return 1;
+}
+
+static int mpc_image_get_data(mpc_image_reader_t *r, void **d) {
+
+  unsigned int kind, i;
+  unsigned long k;
+
+  if (!mpc_image_get_u8(r, &kind)) { return 0; }
+
+  switch (kind) {
+    case MPC_IMAGE_DATA_NULL: *d = NULL; return 1;
+    case MPC_IMAGE_DATA_NAME:
+    case MPC_IMAGE_DATA_PARSER:
+      if (!mpc_image_get_u32(r, &k) || k >= (unsigned long)r->n) { return 0; }
+      *d = kind == MPC_IMAGE_DATA_NAME ? (void*)r->ps[k]->name : (void*)r->ps[k];
+      return 1;
+    case MPC_IMAGE_DATA_TAG:
+      if (!mpc_image_get_u8(r, &i) || i >= sizeof(mpc_image_tags) / sizeof(char*)) { return 0; }
+      *d = (void*)mpc_image_tags[i];
+      return 1;
+    default: return 0;
+  }
+
+}
+
+static mpc_parser_t *mpc_image_get(mpc_image_reader_t *r) {
+
+  unsigned int type, a, b;
+  unsigned long k, j;
+  char *s = NULL;
+  void *d = NULL;
+  mpc_image_fn_t f = NULL, g = NULL;
+  mpc_parser_t *x = NULL, *p;
+  mpc_parser_t **xs;
+  mpc_dtor_t *dxs;
+
+  if (!mpc_image_get_u8(r, &type)) { return NULL; }
+
+  if (type == MPC_IMAGE_REF) {
+    if (!mpc_image_get_u32(r, &k) || k >= (unsigned long)r->n) { return NULL; }
+    return r->ps[k];
+  }
+
+  switch (type) {
+
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_LIFT_VAL:
+      p = mpc_undefined();
+      p->type = type;
+      return p;
+
+    case MPC_TYPE_FAIL:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      if (!mpc_image_get_str(r, &s) || s == NULL) { return NULL; }
+      p = mpc_undefined();
+      p->type = type;
+      if (type == MPC_TYPE_FAIL) { p->data.fail.m = s; } else { p->data.string.x = s; }
+      return p;
+
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SATISFY:
+      if (!mpc_image_get_fn(r, &f) || f == NULL) { return NULL; }
+      p = mpc_undefined();
+      p->type = type;
+      if (type == MPC_TYPE_LIFT)   { p->data.lift.lf = (mpc_ctor_t)f; }
+      if (type == MPC_TYPE_ANCHOR) { p->data.anchor.f = (int(*)(char,char))f; }
+      if (type == MPC_TYPE_SATISFY) { p->data.satisfy.f = (int(*)(char))f; }
+      return p;
+
+    case MPC_TYPE_SINGLE:
+      if (!mpc_image_get_u8(r, &a)) { return NULL; }
+      p = mpc_undefined();
+      p->type = type;
+      p->data.single.x = (char)a;
+      return p;
+
+    case MPC_TYPE_RANGE:
+      if (!mpc_image_get_u8(r, &a) || !mpc_image_get_u8(r, &b)) { return NULL; }
+      p = mpc_undefined();
+      p->type = type;
+      p->data.range.x = (char)a;
+      p->data.range.y = (char)b;
+      return p;
+
+    case MPC_TYPE_EXPECT:
+      if (!mpc_image_get_str(r, &s) || s == NULL) { free(s); return NULL; }
+      if ((x = mpc_image_get(r)) == NULL) { free(s); return NULL; }
+      p = mpc_undefined();
+      p->type = type;
+      p->data.expect.m = s;
+      p->data.expect.x = x;
+      return p;
+
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+      if (!mpc_image_get_fn(r, &f) || f == NULL) { return NULL; }
+      if (type == MPC_TYPE_APPLY_TO && !mpc_image_get_data(r, &d)) { return NULL; }
+      if ((x = mpc_image_get(r)) == NULL) { return NULL; }
+      p = mpc_undefined();
+      p->type = type;
+      if (type == MPC_TYPE_APPLY) {
+        p->data.apply.f = (mpc_apply_t)f;
+        p->data.apply.x = x;
+      } else {
+        p->data.apply_to.f = (mpc_apply_to_t)f;
+        p->data.apply_to.d = d;
+        p->data.apply_to.x = x;
+      }
+      return p;
+
+    case MPC_TYPE_PREDICT:
+      if ((x = mpc_image_get(r)) == NULL) { return NULL; }
+      p = mpc_undefined();
+      p->type = type;
+      p->data.predict.x = x;
+      return p;
+
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      if (!mpc_image_get_fn(r, &f) || !mpc_image_get_fn(r, &g)) { return NULL; }
+      if ((x = mpc_image_get(r)) == NULL) { return NULL; }
+      p = mpc_undefined();
+      p->type = type;
+      p->data.not.dx = (mpc_dtor_t)f;
+      p->data.not.lf = (mpc_ctor_t)g;
+      p->data.not.x = x;
+      return p;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (!mpc_image_get_u32(r, &k)) { return NULL; }
+      if (!mpc_image_get_fn(r, &f) || !mpc_image_get_fn(r, &g)) { return NULL; }
+      if ((x = mpc_image_get(r)) == NULL) { return NULL; }
+      p = mpc_undefined();
+      p->type = type;
+      p->data.repeat.n = (int)k;
+      p->data.repeat.f = (mpc_fold_t)f;
+      p->data.repeat.dx = (mpc_dtor_t)g;
+      p->data.repeat.x = x;
+      return p;
+
+    case MPC_TYPE_OR:
+      /* Every child takes at least a byte */
+      if (!mpc_image_get_u32(r, &k) || k > r->length - r->pos) { return NULL; }
+      xs = malloc(sizeof(mpc_parser_t*) * (k ? k : 1));
+      for (j = 0; j < k; j++) {
+        if ((xs[j] = mpc_image_get(r)) == NULL) {
+          while (j > 0) { mpc_soft_delete(xs[--j]); }
+          free(xs);
+          return NULL;
+        }
+      }
+      p = mpc_undefined();
+      p->type = type;
+      p->data.or.n = (int)k;
+      p->data.or.xs = xs;
+      p->data.or.predict = NULL;
+      return p;
+
+    case MPC_TYPE_AND:
+      if (!mpc_image_get_u32(r, &k) || k == 0 || k > r->length - r->pos) { return NULL; }
+      if (!mpc_image_get_fn(r, &f)) { return NULL; }
+      xs = malloc(sizeof(mpc_parser_t*) * k);
+      dxs = malloc(sizeof(mpc_dtor_t) * k);
+      for (j = 0; j < k-1; j++) {
+        if (!mpc_image_get_fn(r, &g)) { free(xs); free(dxs); return NULL; }
+        dxs[j] = (mpc_dtor_t)g;
+      }
+      for (j = 0; j < k; j++) {
+        if ((xs[j] = mpc_image_get(r)) == NULL) {
+          while (j > 0) { mpc_soft_delete(xs[--j]); }
+          free(xs);
+          free(dxs);
+          return NULL;
+        }
+      }
+      p = mpc_undefined();
+      p->type = type;
+      p->data.and.n = (int)k;
+      p->data.and.f = (mpc_fold_t)f;
+      p->data.and.xs = xs;
+      p->data.and.dxs = dxs;
+      return p;
+
+    default: return NULL;
+  }
+
+}
+
+mpc_err_t *mpc_load(const void *data, size_t length, int n, ...) {
+
+  int i, j;
+  unsigned int version, pooled;
+  unsigned long count, rule;
+  char *name;
+  mpc_image_reader_t r;
+  mpc_parser_t **given;
+  va_list va;
+
+  if (length < 4 || memcmp(data, MPC_IMAGE_MAGIC, 4) != 0) {
+    return mpc_err_file("<mpc_load>", "Not a parser image!");
+  }
+
+  r.data = data;
+  r.length = length;
+  r.pos = 4;
+
+  if (!mpc_image_get_u8(&r, &version) || version != MPC_IMAGE_VERSION) {
+    return mpc_err_file("<mpc_load>", "Unsupported parser image version!");
+  }
+
+  if (!mpc_image_get_u32(&r, &count) || count != (unsigned long)n) {
+    return mpc_err_file("<mpc_load>", "Parser image has a different number of parsers!");
+  }
+
+  given = malloc(sizeof(mpc_parser_t*) * n);
+  r.n = n;
+  r.ps = malloc(sizeof(mpc_parser_t*) * n);
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) { given[i] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
+
+  /* Match saved parsers to the given ones by name */
+  for (i = 0; i < n; i++) {
+    if (!mpc_image_get_str(&r, &name) || name == NULL) { break; }
+    if (!mpc_image_get_u32(&r, &rule) || !mpc_image_get_u8(&r, &pooled)) { free(name); break; }
+    for (j = 0; j < n; j++) {
+      if (given[j]->name && strcmp(given[j]->name, name) == 0) { break; }
+    }
+    free(name);
+    if (j == n) { break; }
+    r.ps[i] = given[j];
+    r.ps[i]->rule = (int)rule;
+    r.ps[i]->pooled = (char)pooled;
+  }
+
+  if (i != n) {
+    free(given);
+    free(r.ps);
+    return mpc_err_file("<mpc_load>", "Parser image doesn't match the given parsers!");
+  }
+
+  /* Decode everything before defining anything */
+  for (i = 0; i < n; i++) {
+    given[i] = mpc_image_get(&r);
+    if (given[i] == NULL || given[i]->retained) {
+      while (i > 0) { mpc_soft_delete(given[--i]); }
+      free(given);
+      free(r.ps);
+      return mpc_err_file("<mpc_load>", "Parser image is corrupt!");
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    pooled = r.ps[i]->pooled;
+    mpc_define(r.ps[i], given[i]);
+    r.ps[i]->pooled = (char)pooled;
+  }
+
+  for (i = 0; i < n; i++) { mpc_optimise(r.ps[i]); }
+
+  free(given);
+  free(r.ps);
+  return NULL;
+}
@@ -71,6 +71,16 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/* Limit on nested combinators while parsing, zero for none */
+void mpc_set_max_depth(int depth);
+
+/*
+** Parsers may be used from several threads at once. Call
+** `mpc_thread_cleanup` before a thread exits to free the memory it
+** kept to reuse on its next parse.
+*/
+void mpc_thread_cleanup(void);
+
 /*
 ** Function Types
 */
@@ -280,12 +290,22 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+/*
+** ASTs parsed with a grammar from `mpca_lang` live in an
+** arena owned by the root node. Calling `mpc_ast_delete`
+** on the root frees the whole tree at once, and calling it
+** on any other node of the tree does nothing.
+*/
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
+  int rule;
   int children_num;
+  int children_max;
   struct mpc_ast_t** children;
+  struct mpc_ast_arena_t *arena;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -337,6 +357,7 @@ mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs);
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
+mpc_parser_t *mpca_rule(mpc_parser_t *a, mpc_parser_t *r);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
 
@@ -350,10 +371,18 @@ mpc_parser_t *mpca_count(int n, mpc_parser_t *a);
 mpc_parser_t *mpca_or(int n, ...);
 mpc_parser_t *mpca_and(int n, ...);
 
+/*
+** With `MPCA_LANG_RULE_IDS` a reference to a rule sets
+** the `rule` of its AST node, if not already set, to the
+** rule's 1-based position in the arguments to `mpca_lang`
+** rather than prefixing the rule name onto `tag`.
+*/
+
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_RULE_IDS             = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -363,6 +392,13 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+/*
+** Saving and Loading
+*/
+
+int mpc_save(FILE *f, int n, ...);
+mpc_err_t *mpc_load(const void *data, size_t length, int n, ...);
+
 /*
 ** Misc
 */
@@ -0,0 +1,375 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+
+#include "threadpool.h"
+
+/* Without pthreads there are no workers and every task runs when waited on */
+#ifdef _WIN32
+
+struct tp_task { tp_fn fn; void* arg; int done; };
+struct threadpool { int pending; };
+
+int threadpool_cpus(void) { return 1; }
+
+threadpool* threadpool_new(int threads, void (*on_exit)(void)) {
+  (void)threads; (void)on_exit;
+  threadpool* p = malloc(sizeof(threadpool));
+  p->pending = 0;
+  return p;
+}
+
+threadpool* threadpool_new_growing(void (*on_exit)(void)) {
+  return threadpool_new(0, on_exit);
+}
+
+tp_task* threadpool_submit(threadpool* p, tp_fn fn, void* arg) {
+  tp_task* t = malloc(sizeof(tp_task));
+  t->fn = fn;
+  t->arg = arg;
+  t->done = 0;
+  p->pending++;
+  return t;
+}
+
+void threadpool_join(threadpool* p, tp_task* t) {
+  (void)p;
+  if (!t->done) {
+    t->done = 1;
+    t->fn(t->arg);
+  }
+}
+
+void threadpool_task_free(threadpool* p, tp_task* t) {
+  p->pending--;
+  free(t);
+}
+
+void threadpool_wait(threadpool* p, tp_task* t) {
+  threadpool_join(p, t);
+  threadpool_task_free(p, t);
+}
+
+void threadpool_detach(threadpool* p, tp_task* t) { threadpool_wait(p, t); }
+
+int threadpool_pending(threadpool* p) { return p->pending; }
+
+void threadpool_del(threadpool* p) { free(p); }
+
+static long tp_events;
+
+long threadpool_event(void) { return tp_events; }
+
+int threadpool_event_wait(long seen) { (void)seen; return 0; }
+
+void threadpool_event_notify(void) { tp_events++; }
+
+#else
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+typedef enum { TP_QUEUED, TP_RUNNING, TP_DONE } tp_state;
+
+/* Queued tasks, oldest at the head */
+typedef struct {
+  tp_task* head;
+  tp_task* tail;
+} tp_queue;
+
+struct tp_task {
+  tp_fn fn;
+  void* arg;
+  tp_state state;
+  /* Freed by the pool once it has run */
+  int detached;
+  tp_queue* queue;
+  struct tp_task* prev;
+  struct tp_task* next;
+};
+
+/* A worker runs the newest task in its own deque first, which holds the
+   tasks it submitted, then the oldest from outside the pool, then steals
+   the oldest from another worker */
+typedef struct {
+  threadpool* pool;
+  int index;
+  pthread_t thread;
+  tp_queue deque;
+} tp_worker;
+
+struct threadpool {
+  pthread_mutex_t lock;
+  /* Signalled when a task is queued or the pool is stopping */
+  pthread_cond_t work;
+  /* Signalled when a task finishes */
+  pthread_cond_t done;
+  /* Tasks submitted by threads outside the pool */
+  tp_queue shared;
+  /* Tasks submitted and not yet freed */
+  int pending;
+  /* Tasks waiting to run, and workers waiting for one */
+  int queued;
+  int idle;
+  /* Start a worker for any task no idle worker can take */
+  int growing;
+  int stop;
+  int count;
+  int cap;
+  /* Pointers, so workers stay put as the array grows */
+  tp_worker** workers;
+  /* The calling thread's tp_worker, if it's one of ours */
+  pthread_key_t self;
+  void (*on_exit)(void);
+};
+
+int threadpool_cpus(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : (int)n;
+}
+
+static void tp_queue_push(tp_queue* q, tp_task* t) {
+  t->queue = q;
+  t->prev = q->tail;
+  t->next = NULL;
+  if (q->tail) { q->tail->next = t; } else { q->head = t; }
+  q->tail = t;
+}
+
+static void tp_queue_unlink(tp_task* t) {
+  tp_queue* q = t->queue;
+  if (t->prev) { t->prev->next = t->next; } else { q->head = t->next; }
+  if (t->next) { t->next->prev = t->prev; } else { q->tail = t->prev; }
+  t->queue = NULL;
+}
+
+/* The task worker w should run next, or NULL, the lock must be held */
+static tp_task* threadpool_next(threadpool* p, tp_worker* w) {
+  if (w->deque.tail) { return w->deque.tail; }
+  if (p->shared.head) { return p->shared.head; }
+
+  /* Start with the next worker along, so thieves spread out */
+  for (int i = 1; i < p->count; i++) {
+    tp_worker* victim = p->workers[(w->index + i) % p->count];
+    if (victim->deque.head) { return victim->deque.head; }
+  }
+  return NULL;
+}
+
+/* Runs t with the lock held on entry and exit */
+static void threadpool_run(threadpool* p, tp_task* t) {
+  tp_queue_unlink(t);
+  p->queued--;
+  t->state = TP_RUNNING;
+  pthread_mutex_unlock(&p->lock);
+
+  t->fn(t->arg);
+
+  pthread_mutex_lock(&p->lock);
+  if (t->detached) {
+    p->pending--;
+    free(t);
+    return;
+  }
+  t->state = TP_DONE;
+  pthread_cond_broadcast(&p->done);
+}
+
+static void* threadpool_worker(void* arg) {
+  tp_worker* w = arg;
+  threadpool* p = w->pool;
+  pthread_setspecific(p->self, w);
+
+  pthread_mutex_lock(&p->lock);
+  while (1) {
+    tp_task* t = threadpool_next(p, w);
+    if (t) { threadpool_run(p, t); continue; }
+    if (p->stop) { break; }
+    p->idle++;
+    pthread_cond_wait(&p->work, &p->lock);
+    p->idle--;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  if (p->on_exit) { p->on_exit(); }
+  return NULL;
+}
+
+/* Workers run the interpreter, which recurses on the C stack, so they
+   get as much as a main thread usually has rather than the platform's
+   default, which can be far smaller */
+enum { TP_STACK = 8 << 20 };
+
+/* Starts another worker with the lock held. Workers start with every
+   signal blocked, so signals such as the profiler's timer are always
+   handled by the threads that use the pool */
+static void threadpool_start(threadpool* p) {
+  if (p->count == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 4;
+    p->workers = realloc(p->workers, sizeof(tp_worker*) * p->cap);
+  }
+  tp_worker* w = malloc(sizeof(tp_worker));
+  w->pool = p;
+  w->index = p->count;
+  w->deque.head = NULL;
+  w->deque.tail = NULL;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, TP_STACK);
+
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  /* Carry on with fewer workers if the system won't give us more */
+  if (pthread_create(&w->thread, &attr, threadpool_worker, w) == 0) {
+    p->workers[p->count++] = w;
+  } else {
+    free(w);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+}
+
+threadpool* threadpool_new(int threads, void (*on_exit)(void)) {
+  threadpool* p = malloc(sizeof(threadpool));
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  pthread_cond_init(&p->done, NULL);
+  pthread_key_create(&p->self, NULL);
+  p->shared.head = NULL;
+  p->shared.tail = NULL;
+  p->pending = 0;
+  p->queued = 0;
+  p->idle = 0;
+  p->growing = 0;
+  p->stop = 0;
+  p->count = 0;
+  p->cap = 0;
+  p->workers = NULL;
+  p->on_exit = on_exit;
+
+  /* The lock keeps workers from stealing while the array is filled in */
+  pthread_mutex_lock(&p->lock);
+  for (int i = 0; i < threads; i++) { threadpool_start(p); }
+  pthread_mutex_unlock(&p->lock);
+
+  return p;
+}
+
+threadpool* threadpool_new_growing(void (*on_exit)(void)) {
+  threadpool* p = threadpool_new(0, on_exit);
+  p->growing = 1;
+  return p;
+}
+
+tp_task* threadpool_submit(threadpool* p, tp_fn fn, void* arg) {
+  tp_task* t = malloc(sizeof(tp_task));
+  t->fn = fn;
+  t->arg = arg;
+  t->state = TP_QUEUED;
+  t->detached = 0;
+
+  tp_worker* w = pthread_getspecific(p->self);
+  pthread_mutex_lock(&p->lock);
+  tp_queue_push(w ? &w->deque : &p->shared, t);
+  p->pending++;
+  p->queued++;
+  if (p->growing && p->queued > p->idle) { threadpool_start(p); }
+  pthread_cond_signal(&p->work);
+  pthread_mutex_unlock(&p->lock);
+
+  return t;
+}
+
+/* Only the task waited for is run here. Running other tasks while t runs
+   elsewhere could start one that waits on a task further down this
+   thread's stack, which would never finish */
+void threadpool_join(threadpool* p, tp_task* t) {
+  pthread_mutex_lock(&p->lock);
+  if (t->state == TP_QUEUED) { threadpool_run(p, t); }
+  while (t->state != TP_DONE) { pthread_cond_wait(&p->done, &p->lock); }
+  pthread_mutex_unlock(&p->lock);
+}
+
+void threadpool_task_free(threadpool* p, tp_task* t) {
+  pthread_mutex_lock(&p->lock);
+  p->pending--;
+  pthread_mutex_unlock(&p->lock);
+  free(t);
+}
+
+void threadpool_wait(threadpool* p, tp_task* t) {
+  threadpool_join(p, t);
+  threadpool_task_free(p, t);
+}
+
+void threadpool_detach(threadpool* p, tp_task* t) {
+  pthread_mutex_lock(&p->lock);
+  if (t->state == TP_DONE) {
+    p->pending--;
+    free(t);
+  } else {
+    t->detached = 1;
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+int threadpool_pending(threadpool* p) {
+  pthread_mutex_lock(&p->lock);
+  int n = p->pending;
+  pthread_mutex_unlock(&p->lock);
+  return n;
+}
+
+void threadpool_del(threadpool* p) {
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+
+  /* Workers only start with the lock held, so none start now. Those still
+     running look through the others for work, so all are freed after */
+  for (int i = 0; i < p->count; i++) { pthread_join(p->workers[i]->thread, NULL); }
+  for (int i = 0; i < p->count; i++) { free(p->workers[i]); }
+
+  pthread_key_delete(p->self);
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->work);
+  pthread_mutex_destroy(&p->lock);
+  free(p->workers);
+  free(p);
+}
+
+/* Waiters register before checking the count and notifiers bump it before
+   looking for waiters, so a waiter either sees the new count or is woken */
+static pthread_mutex_t tp_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tp_event_cond = PTHREAD_COND_INITIALIZER;
+static long tp_events;
+static long tp_event_waiters;
+
+long threadpool_event(void) {
+  return __atomic_load_n(&tp_events, __ATOMIC_SEQ_CST);
+}
+
+int threadpool_event_wait(long seen) {
+  pthread_mutex_lock(&tp_event_lock);
+  __atomic_add_fetch(&tp_event_waiters, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&tp_events, __ATOMIC_SEQ_CST) == seen) {
+    pthread_cond_wait(&tp_event_cond, &tp_event_lock);
+  }
+  __atomic_sub_fetch(&tp_event_waiters, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&tp_event_lock);
+  return 1;
+}
+
+void threadpool_event_notify(void) {
+  __atomic_add_fetch(&tp_events, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&tp_event_waiters, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&tp_event_lock);
+    pthread_cond_broadcast(&tp_event_cond);
+    pthread_mutex_unlock(&tp_event_lock);
+  }
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef CLISPY_THREADPOOL_H
+#define CLISPY_THREADPOOL_H
+
+/* A set of worker threads. Each worker has a deque of the tasks it
+   submits, runs its newest first, and steals the oldest from the others
+   when it has none */
+typedef struct threadpool threadpool;
+typedef struct tp_task tp_task;
+
+typedef void (*tp_fn)(void*);
+
+/* Number of processors online, at least 1 */
+int threadpool_cpus(void);
+
+/* Starts 'threads' workers, which may be 0. Each worker calls 'on_exit'
+   (if not NULL) just before it finishes, to free any thread local state */
+threadpool* threadpool_new(int threads, void (*on_exit)(void));
+
+/* A pool that starts another worker whenever a task is queued with no
+   idle worker to take it, for tasks that may block on one another.
+   Workers stay for the life of the pool, to run later tasks */
+threadpool* threadpool_new_growing(void (*on_exit)(void));
+
+/* Queues fn(arg), the returned task must be passed to threadpool_wait or
+   threadpool_task_free */
+tp_task* threadpool_submit(threadpool* p, tp_fn fn, void* arg);
+
+/* Blocks until the task has run, running it here if no worker has taken
+   it yet, then frees it */
+void threadpool_wait(threadpool* p, tp_task* t);
+
+/* The same without freeing the task, so any number of threads may join it
+   until threadpool_task_free */
+void threadpool_join(threadpool* p, tp_task* t);
+void threadpool_task_free(threadpool* p, tp_task* t);
+
+/* Leaves the task to be freed by the pool once it has run. It can't be
+   waited on after this */
+void threadpool_detach(threadpool* p, tp_task* t);
+
+/* Tasks submitted and not yet freed */
+int threadpool_pending(threadpool* p);
+
+/* Stops the workers and frees the pool, every task must have been waited
+   on or detached. Detached tasks still queued are run first */
+void threadpool_del(threadpool* p);
+
+/* A count, shared by every thread, bumped whenever something threads wait
+   for changes. A thread reads it, checks for what it wants, and if that's
+   not there waits for the count to move on from what it read. Waiting
+   returns 0 where there are no other threads to change anything */
+long threadpool_event(void);
+int threadpool_event_wait(long seen);
+void threadpool_event_notify(void);
+
+#endif